@@ -7,8 +7,8 @@
 using namespace Rcpp;
 
 // survivalEM
-List survivalEM(const arma::mat y, const arma::mat x, const int max_iter, bool async);
-RcppExport SEXP survivalEP_survivalEM(SEXP ySEXP, SEXP xSEXP, SEXP max_iterSEXP, SEXP asyncSEXP) {
+List survivalEM(const arma::mat y, const arma::mat x, const int max_iter, bool async, const int trace, const bool se, const bool keep_eystar);
+RcppExport SEXP survivalEP_survivalEM(SEXP ySEXP, SEXP xSEXP, SEXP max_iterSEXP, SEXP asyncSEXP, SEXP traceSEXP, SEXP seSEXP, SEXP keep_eystarSEXP) {
 BEGIN_RCPP
     Rcpp::RObject __result;
     Rcpp::RNGScope __rngScope;
@@ -16,7 +16,172 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const arma::mat >::type x(xSEXP);
     Rcpp::traits::input_parameter< const int >::type max_iter(max_iterSEXP);
     Rcpp::traits::input_parameter< bool >::type async(asyncSEXP);
-    __result = Rcpp::wrap(survivalEM(y, x, max_iter, async));
+    Rcpp::traits::input_parameter< const int >::type trace(traceSEXP);
+    Rcpp::traits::input_parameter< const bool >::type se(seSEXP);
+    Rcpp::traits::input_parameter< const bool >::type keep_eystar(keep_eystarSEXP);
+    __result = Rcpp::wrap(survivalEM(y, x, max_iter, async, trace, se, keep_eystar));
+    return __result;
+END_RCPP
+}
+// survivalTobitEM
+List survivalTobitEM(const arma::mat lower, const arma::mat upper, const arma::mat x, const int max_iter, bool async, const bool keep_eystar);
+RcppExport SEXP survivalEP_survivalTobitEM(SEXP lowerSEXP, SEXP upperSEXP, SEXP xSEXP, SEXP max_iterSEXP, SEXP asyncSEXP, SEXP keep_eystarSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const arma::mat >::type lower(lowerSEXP);
+    Rcpp::traits::input_parameter< const arma::mat >::type upper(upperSEXP);
+    Rcpp::traits::input_parameter< const arma::mat >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const int >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< bool >::type async(asyncSEXP);
+    Rcpp::traits::input_parameter< const bool >::type keep_eystar(keep_eystarSEXP);
+    __result = Rcpp::wrap(survivalTobitEM(lower, upper, x, max_iter, async, keep_eystar));
+    return __result;
+END_RCPP
+}
+// survivalCV
+List survivalCV(const arma::mat y, const arma::mat x, const IntegerVector folds, const int max_iter, bool async);
+RcppExport SEXP survivalEP_survivalCV(SEXP ySEXP, SEXP xSEXP, SEXP foldsSEXP, SEXP max_iterSEXP, SEXP asyncSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const arma::mat >::type y(ySEXP);
+    Rcpp::traits::input_parameter< const arma::mat >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector >::type folds(foldsSEXP);
+    Rcpp::traits::input_parameter< const int >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< bool >::type async(asyncSEXP);
+    __result = Rcpp::wrap(survivalCV(y, x, folds, max_iter, async));
+    return __result;
+END_RCPP
+}
+// survivalPenalizedEM
+List survivalPenalizedEM(const arma::mat y, const arma::mat x, const int max_iter, const NumericVector lambda, const double alpha, const double tol, Nullable<IntegerVector> unpenalized);
+RcppExport SEXP survivalEP_survivalPenalizedEM(SEXP ySEXP, SEXP xSEXP, SEXP max_iterSEXP, SEXP lambdaSEXP, SEXP alphaSEXP, SEXP tolSEXP, SEXP unpenalizedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const arma::mat >::type y(ySEXP);
+    Rcpp::traits::input_parameter< const arma::mat >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const int >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< const NumericVector >::type lambda(lambdaSEXP);
+    Rcpp::traits::input_parameter< const double >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< const double >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< Nullable<IntegerVector> >::type unpenalized(unpenalizedSEXP);
+    __result = Rcpp::wrap(survivalPenalizedEM(y, x, max_iter, lambda, alpha, tol, unpenalized));
+    return __result;
+END_RCPP
+}
+// survivalPredict
+NumericVector survivalPredict(NumericMatrix x, const NumericVector beta, SEXP out, const std::string type, Nullable<NumericVector> y, const int chunk);
+RcppExport SEXP survivalEP_survivalPredict(SEXP xSEXP, SEXP betaSEXP, SEXP outSEXP, SEXP typeSEXP, SEXP ySEXP, SEXP chunkSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< NumericMatrix >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const NumericVector >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type out(outSEXP);
+    Rcpp::traits::input_parameter< const std::string >::type type(typeSEXP);
+    Rcpp::traits::input_parameter< Nullable<NumericVector> >::type y(ySEXP);
+    Rcpp::traits::input_parameter< const int >::type chunk(chunkSEXP);
+    __result = Rcpp::wrap(survivalPredict(x, beta, out, type, y, chunk));
+    return __result;
+END_RCPP
+}
+// survivalEMAsync
+SEXP survivalEMAsync(const arma::mat y, const arma::mat x, const int max_iter, bool device, const int trace, const bool keep_eystar);
+RcppExport SEXP survivalEP_survivalEMAsync(SEXP ySEXP, SEXP xSEXP, SEXP max_iterSEXP, SEXP deviceSEXP, SEXP traceSEXP, SEXP keep_eystarSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const arma::mat >::type y(ySEXP);
+    Rcpp::traits::input_parameter< const arma::mat >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const int >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< bool >::type device(deviceSEXP);
+    Rcpp::traits::input_parameter< const int >::type trace(traceSEXP);
+    Rcpp::traits::input_parameter< const bool >::type keep_eystar(keep_eystarSEXP);
+    __result = Rcpp::wrap(survivalEMAsync(y, x, max_iter, device, trace, keep_eystar));
+    return __result;
+END_RCPP
+}
+// survivalPoll
+bool survivalPoll(SEXP handle);
+RcppExport SEXP survivalEP_survivalPoll(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type handle(handleSEXP);
+    __result = Rcpp::wrap(survivalPoll(handle));
+    return __result;
+END_RCPP
+}
+// survivalProgress
+int survivalProgress(SEXP handle);
+RcppExport SEXP survivalEP_survivalProgress(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type handle(handleSEXP);
+    __result = Rcpp::wrap(survivalProgress(handle));
+    return __result;
+END_RCPP
+}
+// survivalCancel
+void survivalCancel(SEXP handle);
+RcppExport SEXP survivalEP_survivalCancel(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type handle(handleSEXP);
+    survivalCancel(handle);
+    return R_NilValue;
+END_RCPP
+}
+// survivalWait
+List survivalWait(SEXP handle);
+RcppExport SEXP survivalEP_survivalWait(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type handle(handleSEXP);
+    __result = Rcpp::wrap(survivalWait(handle));
+    return __result;
+END_RCPP
+}
+// survivalPoolStats
+List survivalPoolStats();
+RcppExport SEXP survivalEP_survivalPoolStats() {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    __result = Rcpp::wrap(survivalPoolStats());
+    return __result;
+END_RCPP
+}
+// survivalRelease
+void survivalRelease();
+RcppExport SEXP survivalEP_survivalRelease() {
+BEGIN_RCPP
+    Rcpp::RNGScope __rngScope;
+    survivalRelease();
+    return R_NilValue;
+END_RCPP
+}
+// survivalSimulate
+DataFrame survivalSimulate(const int n, const NumericVector beta, const double rho, const int reps, const int max_iter, bool async, const bool intercept, const double seed, const double level, const double beta_max);
+RcppExport SEXP survivalEP_survivalSimulate(SEXP nSEXP, SEXP betaSEXP, SEXP rhoSEXP, SEXP repsSEXP, SEXP max_iterSEXP, SEXP asyncSEXP, SEXP interceptSEXP, SEXP seedSEXP, SEXP levelSEXP, SEXP beta_maxSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< const int >::type n(nSEXP);
+    Rcpp::traits::input_parameter< const NumericVector >::type beta(betaSEXP);
+    Rcpp::traits::input_parameter< const double >::type rho(rhoSEXP);
+    Rcpp::traits::input_parameter< const int >::type reps(repsSEXP);
+    Rcpp::traits::input_parameter< const int >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< bool >::type async(asyncSEXP);
+    Rcpp::traits::input_parameter< const bool >::type intercept(interceptSEXP);
+    Rcpp::traits::input_parameter< const double >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< const double >::type level(levelSEXP);
+    Rcpp::traits::input_parameter< const double >::type beta_max(beta_maxSEXP);
+    __result = Rcpp::wrap(survivalSimulate(n, beta, rho, reps, max_iter, async, intercept, seed, level, beta_max));
     return __result;
 END_RCPP
 }
@@ -1,9 +1,18 @@
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include <stdlib.h>
+#include <stdint.h>
 
 // Include the stuff for OpenCL
 #define __CL_ENABLE_EXCEPTIONS
@@ -19,14 +28,57 @@
 
 using namespace Rcpp;
 
+// Debug output from code that can run on a background thread (the fits and
+// the device setup) goes to stdout with fprintf, never through the R API
 const bool DEBUG = false;
 
-// The log2(rows) in the partial beta array to run the sequential sum on
-const int CUTOFF = 8;
+// Rows per block in the fixed shape reductions (see reduce_dot)
+const int REDUCE_BLOCK = 256;
+
+// Iterations queued on the device between progress/cancel checks when a
+// fit is being watched by a background job
+const int PROGRESS_BLOCK = 8;
+
+// Progress and cancellation shared between a running fit and its owner
+struct em_control {
+  std::atomic<int> iter;
+  std::atomic<bool> cancel;
+  
+  em_control() : iter(0), cancel(false) {}
+};
+
+typedef std::chrono::steady_clock em_clock;
+
+// Per iteration timings and convergence of a fit, kept in a ring buffer of
+// the last capacity iterations. Everything is allocated up front so the
+// EM loops only write into it.
+struct em_trace {
+  int capacity;
+  int count;
+  std::vector<int> iter;
+  std::vector<double> seconds, estep, mstep, delta, loglik;
+  
+  em_trace(int capacity_in)
+    : capacity(capacity_in), count(0), iter(capacity_in), seconds(capacity_in),
+      estep(capacity_in), mstep(capacity_in), delta(capacity_in), loglik(capacity_in) {}
+  
+  void record(int it, double seconds_in, double estep_in, double mstep_in,
+              double delta_in, double loglik_in) {
+    const int slot = count % capacity;
+    iter[slot] = it;
+    seconds[slot] = seconds_in;
+    estep[slot] = estep_in;
+    mstep[slot] = mstep_in;
+    delta[slot] = delta_in;
+    loglik[slot] = loglik_in;
+    count++;
+  } // end record
+}; // end em_trace
 
 // Store the kernel source code in an array of lines
-const int SOURCE_LINES = 50;
-const char* source[SOURCE_LINES] = {
+const char* source[] = {
+  "// keep the compensated sums and products exactly as written\n",
+  "#pragma OPENCL FP_CONTRACT OFF\n",
   "#define M_SQRT1_2PI_F 0.3989422804\n",
   "// probability functions\n",
   "float dnorm(float x) {\n",
@@ -35,52 +87,181 @@ const char* source[SOURCE_LINES] = {
   "float pnorm(float x) {\n",
   "  return ((1 + erf(x / M_SQRT2_F)) / 2);\n",
   "}\n",
+  "float pnorm_upper(float x) {\n",
+  "  return (erfc(x / M_SQRT2_F) / 2);\n",
+  "}\n",
+  "// inverse Mills ratio dnorm(t) / pnorm_upper(t), on the upper tail so it\n",
+  "// does not cancel for badly mispredicted rows; past t = 10 both would\n",
+  "// soon underflow in float, so it is taken from its asymptotic series\n",
+  "float mills(float t) {\n",
+  "  return t > 10 ? t + ((1 - (2 / (t * t))) / t) : dnorm(t) / pnorm_upper(t);\n",
+  "}\n",
   "float f(float mu) {\n",
-  "  return (dnorm(-mu) / (1 - pnorm(-mu)));\n",
+  "  return mills(-mu);\n",
   "}\n",
   "float g(float mu) {\n",
-  "  return (dnorm(-mu) / pnorm(-mu));\n",
+  "  return mills(mu);\n",
   "}\n",
-  "// kernel for performing the expectation maximization \n",
+  "// kernel for performing the expectation for each (row, outcome); when\n",
+  "// tracing it also leaves each row's log likelihood in loglik\n",
   "kernel void expectation(global float* x, global float* y,\n",
   "                        global float* beta, global float* eystar,\n",
-  "                        const int x_cols, const int x_rows) {\n",
+  "                        const int x_cols, const int x_rows,\n",
+  "                        global float* loglik, const int trace) {\n",
   "  const size_t row = get_global_id(0);\n",
+  "  const size_t out = get_global_id(1);\n",
+  "  const size_t idx = (out * x_rows) + row;\n",
   "  float mu = 0.0;\n",
   "  for (int l = 0; l < x_cols; l++)\n",
-  "    mu += x[(row * x_cols) + l] * beta[l];\n",
-  "  if (y[row] == 1.0)\n",
-  "    eystar[row] = mu + f(mu);\n",
-  "  else if (y[row] == 0.0)\n",
-  "    eystar[row] = mu - g(mu);\n",
-  "}\n"
-  "// kernel for performing multiplication of each z(i,j) and y*(i) \n",
+  "    mu += x[(row * x_cols) + l] * beta[(out * x_cols) + l];\n",
+  "  if (y[idx] == 1.0)\n",
+  "    eystar[idx] = mu + f(mu);\n",
+  "  else if (y[idx] == 0.0)\n",
+  "    eystar[idx] = mu - g(mu);\n",
+  "  if (trace)\n",
+  "    loglik[idx] = y[idx] == 1.0 ? log(pnorm_upper(-mu)) : y[idx] == 0.0 ? log(pnorm_upper(mu)) : 0.0;\n",
+  "}\n",
+  "// kernel for performing multiplication of each z(j,i) and y*(i,k) \n",
   "kernel void beta_part(global float* z, global float* eystar,\n",
   "                      global float* beta_part,\n",
-  "                      const int x_rows) {\n",
+  "                      const int x_cols, const int x_rows) {\n",
   "  const size_t row = get_global_id(0);\n",
   "  const size_t col = get_global_id(1);\n",
-  "  beta_part[(col * x_rows) + row] = z[(col * x_rows) + row] * eystar[row];\n",
-  "}\n"
-  "// kernel for performing addition of each beta(i,j)\n",
-  "kernel void part_sum(global float* beta_part, const int x_rows) {\n",
-  "  const size_t row = get_global_id(0);\n",
+  "  const size_t out = col / x_cols;\n",
+  "  const size_t j = col % x_cols;\n",
+  "  beta_part[(col * x_rows) + row] = z[(j * x_rows) + row] * eystar[(out * x_rows) + row];\n",
+  "}\n",
+  "// kernel for summing each block of rows of beta_part with Kahan\n",
+  "// compensation in four interleaved lanes (as kahan_dot on the host),\n",
+  "// leaving the sum in the first row of the block\n",
+  "kernel void block_sum(global float* beta_part, const int x_rows, const int block) {\n",
+  "  const size_t start = get_global_id(0) * block;\n",
   "  const size_t col = get_global_id(1);\n",
-  "  const size_t n = get_global_size(0);\n",
-  "  const size_t add_row = row + n;\n",
-  "  if (add_row < x_rows)\n",
-  "    beta_part[(col * x_rows) + row] = beta_part[(col * x_rows) + row] + beta_part[(col * x_rows) + add_row];\n",
-  "}\n"
-  "// kernel for performing addition of each beta(i,j)\n",
+  "  const size_t end = min(start + block, (size_t)x_rows);\n",
+  "  float sum[4] = {0.0, 0.0, 0.0, 0.0}, comp[4] = {0.0, 0.0, 0.0, 0.0};\n",
+  "  for (size_t i = start; i < end; i++) {\n",
+  "    const size_t l = (i - start) % 4;\n",
+  "    const float term = beta_part[(col * x_rows) + i] - comp[l];\n",
+  "    const float next = sum[l] + term;\n",
+  "    comp[l] = (next - sum[l]) - term;\n",
+  "    sum[l] = next;\n",
+  "  }\n",
+  "  beta_part[(col * x_rows) + start] = (sum[0] + sum[1]) + (sum[2] + sum[3]);\n",
+  "}\n",
+  "// kernel for adding pairs of block sums that are stride blocks apart\n",
+  "kernel void tree_sum(global float* beta_part, const int x_rows,\n",
+  "                     const int block, const int stride) {\n",
+  "  const size_t b = get_global_id(0) * 2 * stride;\n",
+  "  const size_t col = get_global_id(1);\n",
+  "  const size_t add_b = b + stride;\n",
+  "  if (add_b * block < (size_t)x_rows)\n",
+  "    beta_part[(col * x_rows) + (b * block)] += beta_part[(col * x_rows) + (add_b * block)];\n",
+  "}\n",
+  "// kernel for copying out the total of each column of beta_part\n",
   "kernel void beta_sum(global float* beta_part, global float* beta,\n",
-  "                     const int x_rows, const int min_rows) {\n",
+  "                     const int x_rows) {\n",
   "  const size_t col = get_global_id(0);\n",
-  "  float sum = 0.0;\n",
-  "  for (int i = 0; i < min_rows; i++)\n",
-  "    sum += beta_part[(col * x_rows) + i];\n",
-  "  beta[col] = sum;\n",
+  "  beta[col] = beta_part[col * x_rows];\n",
+  "}\n",
+  "// kernel for the observed information weight 1 - Var(y* | y) of each\n",
+  "// (row, outcome); rows with y not in {0, 1} carry no information\n",
+  "kernel void weights(global float* x, global float* y,\n",
+  "                    global float* beta, global float* w,\n",
+  "                    const int x_cols, const int x_rows) {\n",
+  "  const size_t row = get_global_id(0);\n",
+  "  const size_t out = get_global_id(1);\n",
+  "  const size_t idx = (out * x_rows) + row;\n",
+  "  float mu = 0.0;\n",
+  "  for (int l = 0; l < x_cols; l++)\n",
+  "    mu += x[(row * x_cols) + l] * beta[(out * x_cols) + l];\n",
+  "  float lambda = 0.0;\n",
+  "  if (y[idx] == 1.0) {\n",
+  "    lambda = f(mu);\n",
+  "    w[idx] = lambda * (lambda + mu);\n",
+  "  } else if (y[idx] == 0.0) {\n",
+  "    lambda = g(mu);\n",
+  "    w[idx] = lambda * (lambda - mu);\n",
+  "  } else {\n",
+  "    w[idx] = 0.0;\n",
+  "  }\n",
+  "}\n",
+  "// kernel for the Kahan sum of x(r,a) * x(r,b) * w(r,k) over each block of\n",
+  "// rows, for each outcome k and upper triangle pair (a, b) in pairs\n",
+  "kernel void info_block(global float* x, global float* w,\n",
+  "                       global int* pairs, global float* info_part,\n",
+  "                       const int x_cols, const int x_rows,\n",
+  "                       const int block, const int tri) {\n",
+  "  const size_t b = get_global_id(0);\n",
+  "  const size_t col = get_global_id(1);\n",
+  "  const size_t blocks = get_global_size(0);\n",
+  "  const size_t out = col / tri;\n",
+  "  const size_t t = col % tri;\n",
+  "  const int a = pairs[2 * t];\n",
+  "  const int c = pairs[(2 * t) + 1];\n",
+  "  const size_t start = b * block;\n",
+  "  const size_t end = min(start + block, (size_t)x_rows);\n",
+  "  float sum = 0.0, comp = 0.0;\n",
+  "  for (size_t r = start; r < end; r++) {\n",
+  "    const float term = (x[(r * x_cols) + a] * x[(r * x_cols) + c] * w[(out * x_rows) + r]) - comp;\n",
+  "    const float next = sum + term;\n",
+  "    comp = (next - sum) - term;\n",
+  "    sum = next;\n",
+  "  }\n",
+  "  info_part[(col * blocks) + b] = sum;\n",
+  "}\n",
+  "// kernel for the censored normal expectation of each (row, outcome):\n",
+  "// y* ~ N(mu, sigma^2) truncated to [lower, upper], with lower == upper\n",
+  "// for an observed row and infinite bounds for open ends. Leaves E[y*]\n",
+  "// in eystar and Var(y*) in evar; sigma_sum holds n * sigma^2.\n",
+  "kernel void censored_expectation(global float* lower, global float* upper,\n",
+  "                                 global float* mu, global float* sigma_sum,\n",
+  "                                 global float* eystar, global float* evar,\n",
+  "                                 const int x_rows) {\n",
+  "  const size_t row = get_global_id(0);\n",
+  "  const size_t out = get_global_id(1);\n",
+  "  const size_t idx = (out * x_rows) + row;\n",
+  "  const float l = lower[idx];\n",
+  "  const float u = upper[idx];\n",
+  "  if (l == u) {\n",
+  "    eystar[idx] = l;\n",
+  "    evar[idx] = 0.0;\n",
+  "    return;\n",
+  "  }\n",
+  "  const float sigma = sqrt(sigma_sum[out] / x_rows);\n",
+  "  const float a = (l - mu[idx]) / sigma;\n",
+  "  const float b = (u - mu[idx]) / sigma;\n",
+  "  const float da = isinf(a) ? 0.0 : dnorm(a);\n",
+  "  const float db = isinf(b) ? 0.0 : dnorm(b);\n",
+  "  // each tail from its own side so that neither cancels in float\n",
+  "  const float z = a > 0 ? pnorm_upper(a) - pnorm_upper(b)\n",
+  "                : b <= 0 ? pnorm_upper(-b) - pnorm_upper(-a) : pnorm(b) - pnorm(a);\n",
+  "  if (z <= 0.0) {\n",
+  "    eystar[idx] = isinf(u) ? l : isinf(l) ? u : (l + u) / 2;\n",
+  "    evar[idx] = 0.0;\n",
+  "    return;\n",
+  "  }\n",
+  "  const float lambda = (da - db) / z;\n",
+  "  const float shape = ((isinf(a) ? 0.0 : a * da) - (isinf(b) ? 0.0 : b * db)) / z;\n",
+  "  eystar[idx] = mu[idx] + (sigma * lambda);\n",
+  "  evar[idx] = sigma * sigma * max(1 + shape - (lambda * lambda), 0.0f);\n",
+  "}\n",
+  "// kernel for mu = x * beta at the new beta and each row's share of\n",
+  "// n * sigma^2, (E[y*] - mu)^2 + Var(y*), written over evar\n",
+  "kernel void censored_resid(global float* x, global float* beta,\n",
+  "                           global float* eystar, global float* evar,\n",
+  "                           global float* mu, const int x_cols, const int x_rows) {\n",
+  "  const size_t row = get_global_id(0);\n",
+  "  const size_t out = get_global_id(1);\n",
+  "  const size_t idx = (out * x_rows) + row;\n",
+  "  float m = 0.0;\n",
+  "  for (int l = 0; l < x_cols; l++)\n",
+  "    m += x[(row * x_cols) + l] * beta[(out * x_cols) + l];\n",
+  "  mu[idx] = m;\n",
+  "  const float d = eystar[idx] - m;\n",
+  "  evar[idx] += d * d;\n",
   "}\n"
 };
+const int SOURCE_LINES = sizeof(source) / sizeof(source[0]);
 
 // Open CL objects
 char name[128];
@@ -92,11 +273,205 @@ cl_context context;
 cl_program program;
 cl_kernel exp_kernel;
 cl_kernel beta_part_kernel;
-cl_kernel part_sum_kernel;
-cl_kernel beta_sum_kernel;
+cl_kernel weights_kernel;
+cl_kernel info_block_kernel;
+cl_kernel censored_exp_kernel;
+cl_kernel censored_resid_kernel;
 cl_command_queue queue;
 bool kernel_loaded = false;
 
+// The block, tree and sum kernels of one fixed shape reduction (see
+// enqueue_reduce). A kernel keeps the buffers bound to it, so each sum
+// queued in a fit has its own set.
+struct reducer {
+  cl_kernel block;
+  cl_kernel tree;
+  cl_kernel sum;
+};
+reducer beta_reduce;   // beta = z * E[y*]
+reducer ll_reduce;     // traced log likelihood
+reducer sigma_reduce;  // censored normal n * sigma^2
+reducer info_reduce;   // observed information
+
+// The objects above are shared, so only one fit may use the device at a
+// time; background fits queue up behind each other here. Errors in the
+// OpenCL layer are thrown as std::runtime_error rather than with stop()
+// since they may be raised off the R thread.
+std::mutex device_mutex;
+
+// Alignment (and smallest size class) of pooled buffers
+const size_t POOL_ALIGN = 64;
+
+// Host and device buffers kept between fits, keyed by size class, so
+// repeated fits of the same shape allocate nothing (host_lease and
+// device_lease below take them for a scope). Device buffers are all
+// read/write and belong to the current context, so they are only handed
+// out and dropped while holding device_mutex.
+struct buffer_pool {
+  std::mutex lock;
+  std::map<size_t, std::vector<void*> > host_free;
+  std::map<size_t, std::vector<cl_mem> > device_free;
+  long host_hits, host_misses, device_hits, device_misses;
+  
+  buffer_pool() : host_hits(0), host_misses(0), device_hits(0), device_misses(0) {}
+  
+  // Four classes between each power of two (each a multiple of
+  // POOL_ALIGN), so a buffer is never more than a quarter over its size
+  // and a large one still fits where its exact size would
+  static size_t size_class(size_t bytes) {
+    size_t size = POOL_ALIGN;
+    while (size < bytes)
+      size *= 2;
+    const size_t step = std::max(size / 8, POOL_ALIGN);
+    
+    return ((std::max(bytes, POOL_ALIGN) + step - 1) / step) * step;
+  } // end size_class
+  
+  // Host memory aligned to POOL_ALIGN; the pointer malloc gave back is
+  // kept just in front of the aligned block
+  void* host(size_t bytes) {
+    const size_t size = size_class(bytes);
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<void*>& free_list = host_free[size];
+    if (!free_list.empty()) {
+      void* ptr = free_list.back();
+      free_list.pop_back();
+      host_hits++;
+      return ptr;
+    } // end if
+    
+    host_misses++;
+    void* raw = malloc(size + POOL_ALIGN);
+    if (raw == NULL)
+      throw std::bad_alloc();
+    void* ptr = (void*)(((uintptr_t)raw + POOL_ALIGN) & ~(uintptr_t)(POOL_ALIGN - 1));
+    ((void**)ptr)[-1] = raw;
+    
+    return ptr;
+  } // end host
+  
+  void release(void* ptr, size_t bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    host_free[size_class(bytes)].push_back(ptr);
+  } // end release
+  
+  cl_mem device(size_t bytes) {
+    const size_t size = size_class(bytes);
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<cl_mem>& free_list = device_free[size];
+    if (!free_list.empty()) {
+      cl_mem mem = free_list.back();
+      free_list.pop_back();
+      device_hits++;
+      return mem;
+    } // end if
+    
+    device_misses++;
+    cl_int mem_err;
+    cl_mem mem = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &mem_err);
+    if (mem_err != CL_SUCCESS)
+      throw std::runtime_error("failed to allocate device buffer");
+    
+    return mem;
+  } // end device
+  
+  void release(cl_mem mem, size_t bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    device_free[size_class(bytes)].push_back(mem);
+  } // end release
+  
+  void clear_host() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::map<size_t, std::vector<void*> >::iterator it = host_free.begin(); it != host_free.end(); it++)
+      for (int i = 0; i < it->second.size(); i++)
+        free(((void**)it->second[i])[-1]);
+    host_free.clear();
+  } // end clear_host
+  
+  void clear_device() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::map<size_t, std::vector<cl_mem> >::iterator it = device_free.begin(); it != device_free.end(); it++)
+      for (int i = 0; i < it->second.size(); i++)
+        clReleaseMemObject(it->second[i]);
+    device_free.clear();
+  } // end clear_device
+}; // end buffer_pool
+
+buffer_pool pool;
+
+// Pooled buffers held for the length of a scope, so they go back to the
+// pool however the scope is left, including an error part way through a
+// fit. Each converts to its plain pointer or cl_mem.
+template <class T> struct host_lease {
+  T* ptr;
+  size_t bytes;
+  
+  host_lease(size_t bytes_in) : ptr((T*)pool.host(bytes_in)), bytes(bytes_in) {}
+  ~host_lease() { pool.release((void*)ptr, bytes); }
+  host_lease(const host_lease&) = delete;
+  host_lease& operator=(const host_lease&) = delete;
+  
+  operator T*() const { return ptr; }
+}; // end host_lease
+
+struct device_lease {
+  cl_mem mem;
+  size_t bytes;
+  
+  device_lease() : mem(NULL), bytes(0) {}
+  device_lease(size_t bytes_in) : mem(pool.device(bytes_in)), bytes(bytes_in) {}
+  ~device_lease() {
+    if (mem)
+      pool.release(mem, bytes);
+  } // end ~device_lease
+  device_lease(const device_lease&) = delete;
+  device_lease& operator=(const device_lease&) = delete;
+  
+  // For buffers that are only sometimes needed
+  void take(size_t bytes_in) {
+    mem = pool.device(bytes_in);
+    bytes = bytes_in;
+  } // end take
+  
+  operator cl_mem() const { return mem; }
+}; // end device_lease
+
+// Waits for everything queued when it goes out of scope, so a fit that
+// stops early (by an error) never leaves the device reading or writing
+// its leased buffers once another fit can have them. The pool is only used
+// under device_mutex, so declare it just after taking that lock.
+struct queue_drain {
+  ~queue_drain() {
+    if (kernel_loaded)
+      clFinish(queue);
+  } // end ~queue_drain
+}; // end queue_drain
+
+// Creates the kernels of a reduction from the built program
+void load_reducer(reducer* r, const std::string& what) {
+  r->block = clCreateKernel(program, "block_sum", &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stdout, "code: %d\n", err);
+    throw std::runtime_error(what + " block sum kernel could not be created");
+  }
+  r->tree = clCreateKernel(program, "tree_sum", &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stdout, "code: %d\n", err);
+    throw std::runtime_error(what + " tree sum kernel could not be created");
+  }
+  r->sum = clCreateKernel(program, "beta_sum", &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stdout, "code: %d\n", err);
+    throw std::runtime_error(what + " sum kernel could not be created");
+  }
+} // end load_reducer
+
+void release_reducer(const reducer& r) {
+  clReleaseKernel(r.block);
+  clReleaseKernel(r.tree);
+  clReleaseKernel(r.sum);
+} // end release_reducer
+
 // Loads the devices, etc for using Open CL
 void load_kernel() {
   if (!kernel_loaded) {
@@ -118,7 +493,7 @@ void load_kernel() {
       clGetDeviceInfo(devices[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(int), &this_cus, NULL);
       clGetDeviceInfo(devices[i], CL_DEVICE_NAME, 128, name, NULL);
       clGetDeviceInfo(devices[i], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(long), &mem, NULL);
-      if (DEBUG) Rcout << "Device " << i << ": " << name << " (" << this_cus << " CUs) w " << mem << std::endl;
+      if (DEBUG) fprintf(stdout, "Device %d: %s (%d CUs) w %ld\n", i, name, this_cus, mem);
       
       if (this_cus > max_cus){
         device = devices[i];
@@ -128,66 +503,99 @@ void load_kernel() {
     
     // Print out the device name
     clGetDeviceInfo(device, CL_DEVICE_NAME, 128, name, NULL);
-    if (DEBUG) Rcout << "Using: " << name << std::endl;
+    if (DEBUG) fprintf(stdout, "Using: %s\n", name);
     
     // Create the context for the device
     context = clCreateContext(0, 1, &device, NULL, NULL, &err);
     if (err != CL_SUCCESS)
-      stop("error");
+      throw std::runtime_error("error");
     
     // Create the program from the source code 
     program = clCreateProgramWithSource(context, SOURCE_LINES, source, NULL, &err);
     if (err != CL_SUCCESS) {
       fprintf(stdout, "code: %d\n", err);
-      stop("program could not be created from program source");
+      throw std::runtime_error("program could not be created from program source");
     }
     
     // Build the program
     err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
     if (err != CL_SUCCESS) {
       fprintf(stdout, "code: %d\n", err);
-      stop("program could not be built");
+      throw std::runtime_error("program could not be built");
     }
     
     // Create the expectation kernel
     exp_kernel = clCreateKernel(program, "expectation", &err);
     if (err != CL_SUCCESS) {
       fprintf(stdout, "code: %d\n", err);
-      stop("expectation kernel could not be created");
+      throw std::runtime_error("expectation kernel could not be created");
     }
     
     // Create the beta part kernel
     beta_part_kernel = clCreateKernel(program, "beta_part", &err);
     if (err != CL_SUCCESS) {
       fprintf(stdout, "code: %d\n", err);
-      stop("beta part kernel could not be created");
+      throw std::runtime_error("beta part kernel could not be created");
     }
     
-    // Create the beta part kernel
-    part_sum_kernel = clCreateKernel(program, "part_sum", &err);
+    // Create the reductions
+    load_reducer(&beta_reduce, "beta");
+    load_reducer(&ll_reduce, "log likelihood");
+    load_reducer(&sigma_reduce, "sigma");
+    load_reducer(&info_reduce, "information");
+    
+    // Create the observed information kernels
+    weights_kernel = clCreateKernel(program, "weights", &err);
+    if (err != CL_SUCCESS) {
+      fprintf(stdout, "code: %d\n", err);
+      throw std::runtime_error("weights kernel could not be created");
+    }
+    info_block_kernel = clCreateKernel(program, "info_block", &err);
     if (err != CL_SUCCESS) {
       fprintf(stdout, "code: %d\n", err);
-      stop("part sum kernel could not be created");
+      throw std::runtime_error("info block kernel could not be created");
     }
     
-    // Create the beta part kernel
-    beta_sum_kernel = clCreateKernel(program, "beta_sum", &err);
+    // Create the censored normal kernels
+    censored_exp_kernel = clCreateKernel(program, "censored_expectation", &err);
     if (err != CL_SUCCESS) {
       fprintf(stdout, "code: %d\n", err);
-      stop("beta sum kernel could not be created");
+      throw std::runtime_error("censored expectation kernel could not be created");
+    }
+    censored_resid_kernel = clCreateKernel(program, "censored_resid", &err);
+    if (err != CL_SUCCESS) {
+      fprintf(stdout, "code: %d\n", err);
+      throw std::runtime_error("censored residual kernel could not be created");
     }
     
+    // Create the command queue to execute (profiled for traced fits)
+    queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    if (err != CL_SUCCESS)
+      throw std::runtime_error("command queue could not be created");
+    
     // Don't need to reload
     kernel_loaded = true;
   } // end if
 } // end load_kernel
 
-// Releases the devices, etc used by Open CL
+// Releases the devices, etc used by Open CL (and the pooled device buffers
+// that belong to them)
 void release_kernel() {
+  if (!kernel_loaded)
+    return;
+  
+  pool.clear_device();
+  clReleaseCommandQueue(queue);
   clReleaseKernel(exp_kernel);
   clReleaseKernel(beta_part_kernel);
-  clReleaseKernel(part_sum_kernel);
-  clReleaseKernel(beta_sum_kernel);
+  release_reducer(beta_reduce);
+  release_reducer(ll_reduce);
+  release_reducer(sigma_reduce);
+  release_reducer(info_reduce);
+  clReleaseKernel(weights_kernel);
+  clReleaseKernel(info_block_kernel);
+  clReleaseKernel(censored_exp_kernel);
+  clReleaseKernel(censored_resid_kernel);
   clReleaseProgram(program);
   clReleaseContext(context);
   
@@ -196,236 +604,1788 @@ void release_kernel() {
 } // end release_kernel
 
 double f(double mu) {
-  return ((R::dnorm(-mu, 0, 1, false)) / (1 - R::pnorm(-mu, 0, 1, true, false)));
+  return ((R::dnorm(mu, 0, 1, false)) / (R::pnorm(mu, 0, 1, true, false)));
 } // end f
 
 double g(double mu) {
-  return ((R::dnorm(-mu, 0, 1, false)) / (R::pnorm(-mu, 0, 1, true, false)));
+  return ((R::dnorm(mu, 0, 1, false)) / (R::pnorm(mu, 0, 1, false, false)));
 } // end g
 
-void em_sequential(const arma::mat x, const arma::mat y, const arma::mat z, const int max_iter, 
-                   arma::mat* beta, arma::mat* eystar) {
+// Kahan compensated sum of a[i] * b[i] over [start, end), one block of the
+// fixed shape reductions below. Term i goes to lane (i - start) % 4 so the
+// four compensated sums run independently, and the lanes are then added as
+// (0 + 1) + (2 + 3).
+double kahan_dot(const double* a, const double* b, const int start, const int end) {
+  double sum[4] = {0.0, 0.0, 0.0, 0.0}, comp[4] = {0.0, 0.0, 0.0, 0.0};
+  int i = start;
+  for (; i + 4 <= end; i += 4) {
+    for (int l = 0; l < 4; l++) {
+      const double term = (a[i + l] * b[i + l]) - comp[l];
+      const double next = sum[l] + term;
+      comp[l] = (next - sum[l]) - term;
+      sum[l] = next;
+    } // end for (l)
+  } // end for (i)
+  for (int l = 0; i < end; i++, l++) {
+    const double term = (a[i] * b[i]) - comp[l];
+    const double next = sum[l] + term;
+    comp[l] = (next - sum[l]) - term;
+    sum[l] = next;
+  } // end for (i)
+  
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+} // end kahan_dot
+
+// Fixed shape dot product shared with the device reductions: each block of
+// REDUCE_BLOCK terms is summed with Kahan compensation (kahan_dot) and the
+// block sums are then added pairwise at strides 1, 2, 4, ... The shape
+// only depends on n, so the result is the same for any number of threads.
+double reduce_dot(const double* a, const double* b, const int n) {
+  // Pending subtree sums by height; merging equal heights as blocks arrive
+  // and the rest right to left at the end gives the same tree as the strides
+  double sums[64];
+  int heights[64];
+  int top = 0;
+  
+  for (int start = 0; start < n; start += REDUCE_BLOCK) {
+    sums[top] = kahan_dot(a, b, start, std::min(start + REDUCE_BLOCK, n));
+    heights[top] = 0;
+    top++;
+    while (top > 1 && heights[top - 1] == heights[top - 2]) {
+      sums[top - 2] += sums[top - 1];
+      heights[top - 2]++;
+      top--;
+    } // end while
+  } // end for (start)
+  
+  while (top > 1) {
+    sums[top - 2] += sums[top - 1];
+    top--;
+  } // end while
+  
+  return top > 0 ? sums[0] : 0.0;
+} // end reduce_dot
+
+// Block sums for reduce_crossprod, kept per calling thread so repeated
+// calls (one per EM iteration) allocate nothing once it has grown
+thread_local std::vector<double> reduce_scratch;
+
+// out = a' * b with every element the same fixed shape reduction as
+// reduce_dot; out must already be a.n_cols x b.n_cols. The Kahan sums of
+// every (element, block) pair are spread over threads, then each element's
+// block sums are added pairwise at strides 1, 2, 4, ... so every row block
+// runs in parallel even for a single element and the result still does not
+// depend on the number of threads.
+void reduce_crossprod(const arma::mat& a, const arma::mat& b, arma::mat* out) {
+  const int n = a.n_rows;
+  const int a_cols = a.n_cols;
+  const int cols = a.n_cols * b.n_cols;
+  const int blocks = (n + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+  const long parts = (long)cols * blocks;
+  if (reduce_scratch.size() < (size_t)parts)
+    reduce_scratch.resize(parts);
+  double* sums = reduce_scratch.data();
+  
+  #pragma omp parallel for schedule(static)
+  for (long t = 0; t < parts; t++) {
+    const int c = t / blocks;
+    const int start = (t % blocks) * REDUCE_BLOCK;
+    sums[t] = kahan_dot(a.colptr(c % a_cols), b.colptr(c / a_cols), start,
+                        std::min(start + REDUCE_BLOCK, n));
+  } // end for (t)
+  
+  #pragma omp parallel for schedule(static)
+  for (int c = 0; c < cols; c++) {
+    double* s = sums + ((long)c * blocks);
+    for (int stride = 1; stride < blocks; stride *= 2)
+      for (int k = 0; k + stride < blocks; k += 2 * stride)
+        s[k] += s[k + stride];
+    (*out)(c % a_cols, c / a_cols) = blocks > 0 ? s[0] : 0.0;
+  } // end for (c)
+} // end reduce_crossprod
+
+// beta = xtx_inv * xte for the M-step from x'E[y*], in a fixed order so
+// beta does not depend on the BLAS either; beta must already be p x k
+void normal_solve(const arma::mat& xtx_inv, const arma::mat& xte, arma::mat* beta) {
+  for (int k = 0; k < xte.n_cols; k++) {
+    for (int j = 0; j < xtx_inv.n_rows; j++) {
+      double sum = 0.0;
+      for (int l = 0; l < xtx_inv.n_cols; l++)
+        sum += xtx_inv(j, l) * xte(l, k);
+      (*beta)(j, k) = sum;
+    } // end for (j)
+  } // end for (k)
+} // end normal_solve
+
+// The expectation step: E[y*] for every (row, outcome) given mu = x * beta;
+// also sums the log likelihood at mu into loglik when given
+void expectation(const arma::mat& mu, const arma::mat& y, arma::mat* eystar,
+                 double* loglik = NULL) {
+  for (int k = 0; k < y.n_cols; k++) {
+    for (int r = 0; r < y.n_rows; r++) {
+      if (y(r, k) == 1)
+        (*eystar)(r, k) = mu(r, k) + f(mu(r, k));
+      if (y(r, k) == 0)
+        (*eystar)(r, k) = mu(r, k) - g(mu(r, k));
+      
+      if (loglik && y(r, k) == 1)
+        *loglik += R::pnorm(mu(r, k), 0, 1, true, true);
+      else if (loglik && y(r, k) == 0)
+        *loglik += R::pnorm(mu(r, k), 0, 1, false, true);
+    } // end for (r)
+  } // end for (k)
+} // end expectation
+
+// Fits every column (outcome) of y against the same x; beta is p x k and
+// eystar is n x k. The M-step is beta = (x'x)^-1 (x'E[y*]) with x'E[y*]
+// from the fixed shape reduction, so beta does not depend on the number of
+// threads and the p x n z = (x'x)^-1 x' is never formed.
+void em_sequential(const arma::mat& x, const arma::mat& y, const arma::mat& xtx_inv, const int max_iter, 
+                   arma::mat* beta, arma::mat* eystar, em_control* control = NULL,
+                   em_trace* trace = NULL) {
+  // mu and x'E[y*] allocated once so the iterations themselves allocate
+  // nothing
+  arma::mat mu(x.n_rows, y.n_cols);
+  arma::mat xte(x.n_cols, y.n_cols);
+  
+  // Previous beta for the traced change
+  arma::mat beta_prev;
+  if (trace)
+    beta_prev = *beta;
+  
   // Iterations
   for (int i = 0; i < max_iter; i++) {
-    arma::mat mu = x * (*beta);
+    if (control && control->cancel)
+      break;
     
-    for (int i = 0; i < y.n_rows; i++) {
-      if (y(i, 0) == 1)
-        (*eystar)(i, 0) = mu(i, 0) + f(mu(i, 0));
-      if (y(i, 0) == 0)
-        (*eystar)(i, 0) = mu(i, 0) - g(mu(i, 0));
-    } // end for
+    em_clock::time_point start;
+    if (trace)
+      start = em_clock::now();
+    
+    double loglik = 0.0;
+    mu = x * (*beta);
+    expectation(mu, y, eystar, trace ? &loglik : NULL);
+    
+    em_clock::time_point e_end;
+    if (trace)
+      e_end = em_clock::now();
    
     // maximization step
-    (*beta) = z * (*eystar);
+    reduce_crossprod(x, *eystar, &xte);
+    normal_solve(xtx_inv, xte, beta);
+    
+    if (trace) {
+      const em_clock::time_point m_end = em_clock::now();
+      double delta = 0.0;
+      for (int b = 0; b < beta->n_elem; b++) {
+        delta = std::max(delta, std::abs((*beta)(b) - beta_prev(b)));
+        beta_prev(b) = (*beta)(b);
+      } // end for (b)
+      
+      trace->record(i + 1, std::chrono::duration<double>(m_end - start).count(),
+                    std::chrono::duration<double>(e_end - start).count(),
+                    std::chrono::duration<double>(m_end - e_end).count(), delta, loglik);
+    } // end if
+    
+    if (control)
+      control->iter++;
   } // end for
 } // end em_sequential
 
-void em_parallel(arma::mat* x,  arma::mat y,  arma::mat z,  int max_iter, 
-                      arma::mat* beta, arma::mat* eystar) {
+// Binds a reduction of the columns of parts (rows long, with a block sum
+// every block rows) into totals; it stays bound to r until rebound.
+void bind_reducer(const reducer& r, cl_mem parts, cl_mem totals, cl_int rows, cl_int block) {
+  clSetKernelArg(r.block, 0, sizeof(cl_mem), &parts);
+  clSetKernelArg(r.block, 1, sizeof(cl_int), &rows);
+  clSetKernelArg(r.block, 2, sizeof(cl_int), &block);
+  // -- the stride is set as the tree sums are queued
+  clSetKernelArg(r.tree, 0, sizeof(cl_mem), &parts);
+  clSetKernelArg(r.tree, 1, sizeof(cl_int), &rows);
+  clSetKernelArg(r.tree, 2, sizeof(cl_int), &block);
+  clSetKernelArg(r.sum, 0, sizeof(cl_mem), &parts);
+  clSetKernelArg(r.sum, 1, sizeof(cl_mem), &totals);
+  clSetKernelArg(r.sum, 2, sizeof(cl_int), &rows);
+} // end bind_reducer
+
+// Queues the fixed shape reduction of each of the cols columns of the
+// buffer bound to r: Kahan sums of each block of REDUCE_BLOCK rows, block
+// sums added pairwise at strides 1, 2, 4, ... and the totals copied out.
+// Matches reduce_dot on the host.
+void enqueue_tree(const reducer& r, const int blocks, const int cols, cl_event* done) {
+  const size_t sum_dims[] = {(size_t)cols};
+  for (cl_int stride = 1; stride < blocks; stride *= 2) {
+    const size_t tree_dims[] = {(size_t)((blocks + (2 * stride) - 1) / (2 * stride)), (size_t)cols};
+    clSetKernelArg(r.tree, 3, sizeof(cl_int), &stride);
+    clEnqueueNDRangeKernel(queue, r.tree, 2, NULL, tree_dims, NULL, 0, NULL, NULL);
+  } // end for
+  
+  clEnqueueNDRangeKernel(queue, r.sum, 1, NULL, sum_dims, NULL, 0, NULL, done);
+} // end enqueue_tree
+
+void enqueue_reduce(const reducer& r, const int x_rows, const int cols, cl_event* done) {
+  const int blocks = (x_rows + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+  const size_t block_dims[] = {(size_t)blocks, (size_t)cols};
+  clEnqueueNDRangeKernel(queue, r.block, 2, NULL, block_dims, NULL, 0, NULL, NULL);
+  enqueue_tree(r, blocks, cols, done);
+} // end enqueue_reduce
+
+// Copies m into fl as floats, column by column (or row by row, as x and z
+// are read on the device) and queues its upload to io. fl has to stay put
+// until the queue has finished.
+void upload(const arma::mat& m, float* fl, cl_mem io, const bool by_row = false) {
+  const int rows = m.n_rows;
+  const int cols = m.n_cols;
+  for (int c = 0; c < cols; c++)
+    for (int r = 0; r < rows; r++)
+      fl[by_row ? (r * cols) + c : (c * rows) + r] = (float)m(r, c);
+  
+  if (clEnqueueWriteBuffer(queue, io, CL_FALSE, 0, sizeof(float) * m.n_elem, fl, 0, NULL, NULL) != CL_SUCCESS)
+    throw std::runtime_error("failed to write input buffer");
+} // end upload
+
+// Reads io back through fl into m (already sized), column by column
+void download(cl_mem io, float* fl, arma::mat* m, const char* what) {
+  if (clEnqueueReadBuffer(queue, io, CL_TRUE, 0, sizeof(float) * m->n_elem, fl, 0, NULL, NULL) != CL_SUCCESS)
+    throw std::runtime_error(std::string("failed to read out ") + what);
+  
+  const int rows = m->n_rows;
+  for (int c = 0; c < (int)m->n_cols; c++)
+    for (int r = 0; r < rows; r++)
+      (*m)(r, c) = fl[(c * rows) + r];
+} // end download
+
+// What em_parallel and tobit_parallel both keep on the device: x and z
+// for the expectation and the M-step, beta (uploaded at its starting
+// value) and the partial products it is reduced from each iteration.
+// load_kernel has to have been called, under device_mutex.
+struct device_design {
+  const cl_int x_rows;
+  const cl_int x_cols;
+  host_lease<float> x_fl;
+  host_lease<float> z_fl;
+  host_lease<float> beta_fl;
+  device_lease x_in;
+  device_lease z_in;
+  device_lease beta_part_io;
+  device_lease beta_io;
+  
+  device_design(const arma::mat& x, const arma::mat& z, const arma::mat& beta)
+    : x_rows(x.n_rows), x_cols(x.n_cols),
+      x_fl(sizeof(float) * x.n_elem), z_fl(sizeof(float) * z.n_elem),
+      beta_fl(sizeof(float) * beta.n_elem), x_in(sizeof(float) * x.n_elem),
+      z_in(sizeof(float) * z.n_elem), beta_part_io(sizeof(float) * (x.n_rows * beta.n_elem)),
+      beta_io(sizeof(float) * beta.n_elem) {
+    upload(x, x_fl, x_in, true);
+    upload(z, z_fl, z_in, true);
+    upload(beta, beta_fl, beta_io);
+  } // end device_design
+  
+  // Binds beta = z * E[y*] for the expectations in eystar_io
+  void bind_mstep(cl_mem eystar_io) {
+    clSetKernelArg(beta_part_kernel, 0, sizeof(cl_mem), &z_in.mem);
+    clSetKernelArg(beta_part_kernel, 1, sizeof(cl_mem), &eystar_io);
+    clSetKernelArg(beta_part_kernel, 2, sizeof(cl_mem), &beta_part_io.mem);
+    clSetKernelArg(beta_part_kernel, 3, sizeof(cl_int), &x_cols);
+    clSetKernelArg(beta_part_kernel, 4, sizeof(cl_int), &x_rows);
+    bind_reducer(beta_reduce, beta_part_io, beta_io, x_rows, REDUCE_BLOCK);
+  } // end bind_mstep
+  
+  // Queues one M-step for y_cols outcomes; done marks the end of the beta sum
+  void enqueue_mstep(const int y_cols, cl_event* done) {
+    const size_t beta_part_dims[] = {(size_t)x_rows, (size_t)(x_cols * y_cols)};
+    clEnqueueNDRangeKernel(queue, beta_part_kernel, 2, NULL, beta_part_dims, NULL, 0, NULL, NULL);
+    enqueue_reduce(beta_reduce, x_rows, x_cols * y_cols, done);
+  } // end enqueue_mstep
+}; // end device_design
+
+// Most partial sums (floats) info_parallel keeps on the device at once
+const long INFO_PART_MAX = 1L << 24;
+
+// Observed information x' diag(w) x of each outcome at the beta in beta_io
+// (Louis' formula, see info_sequential) from the data already on the
+// device: one fused pass for the weights, then the upper triangle of each
+// matrix through the block/tree reduction. Blocks are REDUCE_BLOCK rows
+// unless that would take more than INFO_PART_MAX partial sums, in which
+// case there are fewer, longer blocks. Fills info (p x p x k).
+void info_parallel(cl_mem x_in, cl_mem y_in, cl_mem beta_io, const int x_rows,
+                   const int x_cols, const int y_cols, arma::cube* info) {
+  const int tri = (x_cols * (x_cols + 1)) / 2;
+  const long max_blocks = std::max(1L, INFO_PART_MAX / ((long)tri * y_cols));
+  const int blocks = (int)std::min((long)(x_rows + REDUCE_BLOCK - 1) / REDUCE_BLOCK, max_blocks);
+  const int block = (x_rows + blocks - 1) / blocks;
+  const size_t w_bytes = sizeof(float) * (x_rows * y_cols);
+  const size_t pairs_bytes = sizeof(cl_int) * (2 * tri);
+  const size_t part_bytes = sizeof(float) * ((size_t)tri * y_cols * blocks);
+  const size_t info_bytes = sizeof(float) * (tri * y_cols);
+  
+  // Upper triangle pairs
+  host_lease<cl_int> pairs_in(pairs_bytes);
+  host_lease<float> info_fl(info_bytes);
+  int t = 0;
+  for (int a = 0; a < x_cols; a++) {
+    for (int b = a; b < x_cols; b++) {
+      pairs_in[2 * t] = a;
+      pairs_in[(2 * t) + 1] = b;
+      t++;
+    } // end for (b)
+  } // end for (a)
+  
+  device_lease w_io(w_bytes);
+  device_lease pairs_io(pairs_bytes);
+  device_lease part_io(part_bytes);
+  device_lease info_io(info_bytes);
+  if (clEnqueueWriteBuffer(queue, pairs_io, CL_FALSE, 0, pairs_bytes, pairs_in, 0, NULL, NULL) != CL_SUCCESS)
+    throw std::runtime_error("failed to write pairs buffer");
+  
+  // Set the parameters
+  const cl_int x_cols_in = x_cols;
+  const cl_int x_rows_in = x_rows;
+  const cl_int block_in = block;
+  const cl_int tri_in = tri;
+  // -- weights
+  clSetKernelArg(weights_kernel, 0, sizeof(cl_mem), &x_in);
+  clSetKernelArg(weights_kernel, 1, sizeof(cl_mem), &y_in);
+  clSetKernelArg(weights_kernel, 2, sizeof(cl_mem), &beta_io);
+  clSetKernelArg(weights_kernel, 3, sizeof(cl_mem), &w_io.mem);
+  clSetKernelArg(weights_kernel, 4, sizeof(cl_int), &x_cols_in);
+  clSetKernelArg(weights_kernel, 5, sizeof(cl_int), &x_rows_in);
+  // -- info blocks
+  clSetKernelArg(info_block_kernel, 0, sizeof(cl_mem), &x_in);
+  clSetKernelArg(info_block_kernel, 1, sizeof(cl_mem), &w_io.mem);
+  clSetKernelArg(info_block_kernel, 2, sizeof(cl_mem), &pairs_io.mem);
+  clSetKernelArg(info_block_kernel, 3, sizeof(cl_mem), &part_io.mem);
+  clSetKernelArg(info_block_kernel, 4, sizeof(cl_int), &x_cols_in);
+  clSetKernelArg(info_block_kernel, 5, sizeof(cl_int), &x_rows_in);
+  clSetKernelArg(info_block_kernel, 6, sizeof(cl_int), &block_in);
+  clSetKernelArg(info_block_kernel, 7, sizeof(cl_int), &tri_in);
+  // -- the block sums are one apart in rows of length blocks
+  bind_reducer(info_reduce, part_io, info_io, blocks, 1);
+  
+  // Queue up the kernels for execution
+  const size_t weights_dims[] = {(size_t)x_rows, (size_t)y_cols};
+  const size_t info_dims[] = {(size_t)blocks, (size_t)(tri * y_cols)};
+  clEnqueueNDRangeKernel(queue, weights_kernel, 2, NULL, weights_dims, NULL, 0, NULL, NULL);
+  clEnqueueNDRangeKernel(queue, info_block_kernel, 2, NULL, info_dims, NULL, 0, NULL, NULL);
+  enqueue_tree(info_reduce, blocks, tri * y_cols, NULL);
+  
+  // Read out our results
+  if (clEnqueueReadBuffer(queue, info_io, CL_TRUE, 0, info_bytes, info_fl, 0, NULL, NULL) != CL_SUCCESS)
+    throw std::runtime_error("failed to read out info");
+  
+  info->set_size(x_cols, x_cols, y_cols);
+  for (int k = 0; k < y_cols; k++) {
+    t = 0;
+    for (int a = 0; a < x_cols; a++) {
+      for (int b = a; b < x_cols; b++) {
+        (*info)(a, b, k) = info_fl[(k * tri) + t];
+        (*info)(b, a, k) = info_fl[(k * tri) + t];
+        t++;
+      } // end for (b)
+    } // end for (a)
+  } // end for (k)
+} // end info_parallel
+
+// eystar may be NULL when only beta is wanted, in which case it is never
+// read back from the device
+void em_parallel(const arma::mat& x, const arma::mat& y, const arma::mat& z, int max_iter, 
+                      arma::mat* beta, arma::mat* eystar, em_control* control = NULL,
+                      em_trace* trace = NULL, arma::cube* info = NULL) {
+  std::lock_guard<std::mutex> device_lock(device_mutex);
+  queue_drain drain;
+  
   // Get the dimensions
-  const int x_cols = (*x).n_cols;
-  const int x_rows = (*x).n_rows;
-  
-  // Create float arrays for the data
-  float *x_fl = new float[x_rows * x_cols];
-  float *y_fl = new float[x_rows];
-  float *z_fl = new float[x_cols * x_rows];
-  float *beta_part_fl = new float[x_cols * x_rows];
-  float *beta_fl = new float[x_cols];
-  float *eystar_fl = new float[x_rows];
-  
-  // Copy the data to arrays
-  for (int i = 0; i < x_rows; i++){
-    y_fl[i] = (float)y(i, 0);
-    
-    for (int j = 0; j < x_cols; j++) {
-      x_fl[(i * x_cols) + j] = (float)(*x)(i, j);
-      z_fl[(j * x_rows) + i] = (float)z(j, i);
-      beta_part_fl[(j * x_rows) + i] = 0.0;
-      
-      if (i == 0)
-        beta_fl[j] = 0.0;
-    } // end for (j)
-  } // end for (i)
-  if (DEBUG) warning("got here 0");
+  const int x_cols = x.n_cols;
+  const int x_rows = x.n_rows;
+  const int y_cols = y.n_cols;
+  
+  // One partial product column per (outcome, beta) pair
+  const int part_cols = x_cols * y_cols;
+  const size_t y_bytes = sizeof(float) * (x_rows * y_cols);
   
-  // Load the OpenCL device stuff
+  // Load the OpenCL device stuff (kept loaded, with its queue, between fits)
   load_kernel();
-
-  // Create the command queue to execute
-  queue = clCreateCommandQueue(context, device, 0, &err);
-  if (err != CL_SUCCESS)
-    stop("command queue could not be created");
-  if (DEBUG) warning("got here 2");
-    
-  // Set the input memory
-  cl_mem x_in = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * (x_rows * x_cols),  x_fl, &err);
-  cl_mem y_in = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * x_rows,  y_fl, &err);
-  cl_mem z_in = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * (x_cols * x_rows),  z_fl, &err);
-  if (err != CL_SUCCESS)
-    stop("failed to allocate input buffer");
-  if (DEBUG) warning("got here 3");
-  
-  // Set the input/output memory
-  cl_mem beta_part_io = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(float) * (x_cols * x_rows), beta_part_fl, &err);
-  cl_mem beta_io = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(float) * x_cols, beta_fl, &err);
-  cl_mem eystar_io = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(float) * x_rows, eystar_fl, &err);
-  if (err != CL_SUCCESS)
-    stop("failed to allocate i/o buffer");
-  if (DEBUG) warning("got here 3.5");
+  if (DEBUG) fprintf(stdout, "got here 2\n");
+  
+  // Upload the data (the host arrays stay put until the queue has
+  // finished), with beta and eystar starting at zero
+  device_design design(x, z, *beta);
+  host_lease<float> y_fl(y_bytes);
+  host_lease<float> eystar_fl(y_bytes);
+  device_lease y_in(y_bytes);
+  device_lease eystar_io(y_bytes);
+  upload(y, y_fl, y_in);
+  std::fill(eystar_fl.ptr, eystar_fl.ptr + (x_rows * y_cols), 0.0f);
+  if (clEnqueueWriteBuffer(queue, eystar_io, CL_FALSE, 0, y_bytes, eystar_fl, 0, NULL, NULL) != CL_SUCCESS)
+    throw std::runtime_error("failed to write input buffer");
+  if (DEBUG) fprintf(stdout, "got here 3\n");
+  
+  // Set the trace memory: per row log likelihood, its sums and a history
+  // of beta and the log likelihood for each iteration in a block
+  device_lease ll_io, ll_sum_io, beta_hist_io, ll_hist_io;
+  std::vector<float> beta_hist_fl, ll_hist_fl, beta_prev_fl;
+  std::vector<cl_event> exp_events, max_events;
+  if (trace) {
+    ll_io.take(y_bytes);
+    ll_sum_io.take(sizeof(float) * y_cols);
+    beta_hist_io.take(sizeof(float) * (PROGRESS_BLOCK * part_cols));
+    ll_hist_io.take(sizeof(float) * (PROGRESS_BLOCK * y_cols));
+    
+    beta_hist_fl.resize(PROGRESS_BLOCK * part_cols);
+    ll_hist_fl.resize(PROGRESS_BLOCK * y_cols);
+    beta_prev_fl.assign(design.beta_fl.ptr, design.beta_fl.ptr + part_cols);
+    exp_events.resize(PROGRESS_BLOCK);
+    max_events.resize(PROGRESS_BLOCK);
+  } // end if
     
   // Set scalar memory
   const cl_int x_cols_in = x_cols;
   const cl_int x_rows_in = x_rows;
-  const cl_int min_rows_in = (int)pow(2, CUTOFF);
+  const cl_int trace_in = trace ? 1 : 0;
   
   // Set the parameters
   // -- expectation
-  clSetKernelArg(exp_kernel, 0, sizeof(cl_mem), &x_in);
-  clSetKernelArg(exp_kernel, 1, sizeof(cl_mem), &y_in);
-  clSetKernelArg(exp_kernel, 2, sizeof(cl_mem), &beta_io);
-  clSetKernelArg(exp_kernel, 3, sizeof(cl_mem), &eystar_io);
+  clSetKernelArg(exp_kernel, 0, sizeof(cl_mem), &design.x_in.mem);
+  clSetKernelArg(exp_kernel, 1, sizeof(cl_mem), &y_in.mem);
+  clSetKernelArg(exp_kernel, 2, sizeof(cl_mem), &design.beta_io.mem);
+  clSetKernelArg(exp_kernel, 3, sizeof(cl_mem), &eystar_io.mem);
   clSetKernelArg(exp_kernel, 4, sizeof(cl_int), &x_cols_in);
   clSetKernelArg(exp_kernel, 5, sizeof(cl_int), &x_rows_in);
-  // -- beta part
-  clSetKernelArg(beta_part_kernel, 0, sizeof(cl_mem), &z_in);
-  clSetKernelArg(beta_part_kernel, 1, sizeof(cl_mem), &eystar_io);
-  clSetKernelArg(beta_part_kernel, 2, sizeof(cl_mem), &beta_part_io);
-  clSetKernelArg(beta_part_kernel, 3, sizeof(cl_int), &x_rows_in);
-  // -- sum part
-  clSetKernelArg(part_sum_kernel, 0, sizeof(cl_mem), &beta_part_io);
-  clSetKernelArg(part_sum_kernel, 1, sizeof(cl_int), &x_rows_in);
-  // -- beta sum
-  clSetKernelArg(beta_sum_kernel, 0, sizeof(cl_mem), &beta_part_io);
-  clSetKernelArg(beta_sum_kernel, 1, sizeof(cl_mem), &beta_io);
-  clSetKernelArg(beta_sum_kernel, 2, sizeof(cl_int), &x_rows_in);
-  clSetKernelArg(beta_sum_kernel, 3, sizeof(cl_int), &min_rows_in);
-  
-  if (DEBUG) warning("got here 5");
+  clSetKernelArg(exp_kernel, 6, sizeof(cl_mem), &ll_io.mem);
+  clSetKernelArg(exp_kernel, 7, sizeof(cl_int), &trace_in);
+  // -- M-step
+  design.bind_mstep(eystar_io);
+  // -- log likelihood sums (traced only)
+  if (trace)
+    bind_reducer(ll_reduce, ll_io, ll_sum_io, x_rows, REDUCE_BLOCK);
+  
+  if (DEBUG) fprintf(stdout, "got here 5\n");
   
   // Initialize
-  const int log_rows = (int)ceilf(log2f(x_rows));
-  const int part_sums = log_rows - (CUTOFF - 1);
-  const int exp_dim = 1;
-  const int beta_part_dim = 2;
-  const int part_sum_dim = 2;
-  const int beta_sum_dim = 1;
-  const size_t exp_dims[] = {x_rows};
-  const size_t beta_part_dims[] = {x_rows, x_cols};
-  const size_t beta_sum_dims[] = {x_cols};
-  
-  if (DEBUG) warning("got here 5.5");
+  const int exp_dim = 2;
+  const size_t exp_dims[] = {(size_t)x_rows, (size_t)y_cols};
+  
+  if (DEBUG) fprintf(stdout, "got here 5.5\n");
   
   // Queue up the kernels for execution
   for (int i = 0; i < max_iter; i++) { 
+    const int slot = i % PROGRESS_BLOCK;
+    
     // expectation
-    clEnqueueNDRangeKernel(queue, exp_kernel, exp_dim, NULL, exp_dims, NULL, 0, NULL, NULL);
+    clEnqueueNDRangeKernel(queue, exp_kernel, exp_dim, NULL, exp_dims, NULL, 0, NULL,
+                           trace ? &exp_events[slot] : NULL);
     
     // beta = z * y*
-    clEnqueueNDRangeKernel(queue, beta_part_kernel, beta_part_dim, NULL, beta_part_dims, NULL, 0, NULL, NULL);
+    design.enqueue_mstep(y_cols, trace ? &max_events[slot] : NULL);
+    if (trace)
+      clEnqueueCopyBuffer(queue, design.beta_io, beta_hist_io, 0, sizeof(float) * (slot * part_cols),
+                          sizeof(float) * part_cols, 0, NULL, NULL);
     
-    // partial sums
-    for (int s = 1; s < part_sums; s++) {
-      const int rows = (int)pow(2, log_rows - s);
-      const size_t part_sum_dims[] = {rows, x_cols};
-      clEnqueueNDRangeKernel(queue, part_sum_kernel, part_sum_dim, NULL, part_sum_dims, NULL, 0, NULL, NULL);
-    } // end for
+    // log likelihood sums, kept by iteration within the block; queued
+    // after the M-step so the mstep time is only the beta reduction
+    if (trace) {
+      enqueue_reduce(ll_reduce, x_rows, y_cols, NULL);
+      clEnqueueCopyBuffer(queue, ll_sum_io, ll_hist_io, 0, sizeof(float) * (slot * y_cols),
+                          sizeof(float) * y_cols, 0, NULL, NULL);
+    } // end if
     
-    // full sums
-    clEnqueueNDRangeKernel(queue, beta_sum_kernel, beta_sum_dim, NULL, beta_sum_dims, NULL, 0, NULL, NULL);
+    // When watched or traced, let each block of iterations drain before
+    // reporting so a cancel stops within a block
+    if ((control || trace) && (slot + 1 == PROGRESS_BLOCK || i + 1 == max_iter)) {
+      clFinish(queue);
+      
+      if (trace) {
+        clEnqueueReadBuffer(queue, beta_hist_io, CL_TRUE, 0, sizeof(float) * ((slot + 1) * part_cols),
+                            beta_hist_fl.data(), 0, NULL, NULL);
+        clEnqueueReadBuffer(queue, ll_hist_io, CL_TRUE, 0, sizeof(float) * ((slot + 1) * y_cols),
+                            ll_hist_fl.data(), 0, NULL, NULL);
+        
+        for (int b = 0; b <= slot; b++) {
+          cl_ulong e_start, e_end, m_end;
+          clGetEventProfilingInfo(exp_events[b], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &e_start, NULL);
+          clGetEventProfilingInfo(exp_events[b], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &e_end, NULL);
+          clGetEventProfilingInfo(max_events[b], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &m_end, NULL);
+          clReleaseEvent(exp_events[b]);
+          clReleaseEvent(max_events[b]);
+          
+          double delta = 0.0, loglik = 0.0;
+          for (int c = 0; c < part_cols; c++) {
+            const float next = beta_hist_fl[(b * part_cols) + c];
+            delta = std::max(delta, (double)std::abs(next - beta_prev_fl[c]));
+            beta_prev_fl[c] = next;
+          } // end for (c)
+          for (int k = 0; k < y_cols; k++)
+            loglik += ll_hist_fl[(b * y_cols) + k];
+          
+          trace->record(i - slot + b + 1, (m_end - e_start) * 1e-9, (e_end - e_start) * 1e-9,
+                        (m_end - e_end) * 1e-9, delta, loglik);
+        } // end for (b)
+      } // end if
+      
+      if (control) {
+        control->iter = i + 1;
+        if (control->cancel)
+          break;
+      } // end if
+    } // end if
   }// end for
-  if (DEBUG) warning("got here 6");
+  if (DEBUG) fprintf(stdout, "got here 6\n");
   
   // Execute
   clFlush(queue);
   clFinish(queue);
-  if (DEBUG) warning("got here 7");
+  if (DEBUG) fprintf(stdout, "got here 7\n");
+  
+  // Observed information at the final beta, while the data is still there
+  if (info)
+    info_parallel(design.x_in, y_in, design.beta_io, x_rows, x_cols, y_cols, info);
   
   // Read out our results
-  if (clEnqueueReadBuffer(queue, beta_io, CL_TRUE, 0, sizeof(float) * x_cols, beta_fl, 0, NULL, NULL) != CL_SUCCESS)
-    stop("failed to read out beta");
-  if (clEnqueueReadBuffer(queue, eystar_io, CL_TRUE, 0, sizeof(float) * x_rows, eystar_fl, 0, NULL, NULL) != CL_SUCCESS)
-    stop("failed to read out eystar");
-  if (clEnqueueReadBuffer(queue, beta_part_io, CL_TRUE, 0, sizeof(float) * x_cols * x_rows, beta_part_fl, 0, NULL, NULL) != CL_SUCCESS)
-    stop("failed to read out beta_part");
-  
-  if (DEBUG) warning("got here 8");
-    
-  // Extract results
-  for (int i = 0; i < x_cols; i++)
-    (*beta)(i, 0) = beta_fl[i];
-  for (int i = 0; i < x_rows; i++)
-    (*eystar)(i, 0) = eystar_fl[i];
-
-  for (int i = 0; i < x_rows; i++) {
-    for (int j = 0; j < x_cols; j++) {
-      if (DEBUG) Rcout << beta_part_fl[(j * x_rows) + i] << " ";
-      (*x)(i,j) = (double)beta_part_fl[(j * x_rows) + i];
-    }
-    if (DEBUG) Rcout << std::endl;
-  } 
-  
-  if (DEBUG) warning("got here 9");
-  
-  // Clean up OpenCL resources
-  clReleaseMemObject(x_in);
-  clReleaseMemObject(y_in);
-  clReleaseMemObject(z_in);
-  clReleaseMemObject(beta_part_io);
-  clReleaseMemObject(beta_io);
-  clReleaseMemObject(eystar_io);
-    
-  // Release memory
-  delete [] x_fl;
-  delete [] y_fl;
-  delete [] z_fl;
-  delete [] beta_fl;
-  delete [] beta_part_fl;
-  delete [] eystar_fl;
- 
-  // Clean up OpenCL resources (the rest)
-  clReleaseCommandQueue(queue);
-  release_kernel();
+  download(design.beta_io, design.beta_fl, beta, "beta");
+  if (eystar)
+    download(eystar_io, eystar_fl, eystar, "eystar");
+  
+  if (DEBUG) fprintf(stdout, "got here 8\n");
 } // end em_parallel
 
+// Rows per chunk and columns per tile of the observed information
+const int INFO_ROWS = 1024;
+const int INFO_TILE = 16;
+
+// Observed information of each outcome at beta by Louis' formula: the
+// complete data information x'x less the missing information
+// x' diag(Var(y* | y)) x, i.e. x' diag(w) x with w = 1 - Var(y* | y).
+// Rows with y not in {0, 1} carry no information. One pass over x for the
+// weights, then each thread owns whole tiles of INFO_TILE rows of the lower
+// triangle and adds up the chunks of rows into them in order, so beyond
+// the weights (n x k) nothing is allocated and the sums do not depend on
+// the number of threads. Fills info (p x p x k).
+void info_sequential(const arma::mat& x, const arma::mat& y, const arma::mat& beta,
+                     arma::cube* info) {
+  const int n = x.n_rows;
+  const int p = x.n_cols;
+  const int y_cols = y.n_cols;
+  const int tiles = (p + INFO_TILE - 1) / INFO_TILE;
+  
+  arma::mat w(n, y_cols);
+  #pragma omp parallel for schedule(static)
+  for (int r = 0; r < n; r++) {
+    for (int k = 0; k < y_cols; k++) {
+      double mu = 0.0;
+      for (int l = 0; l < p; l++)
+        mu += x(r, l) * beta(l, k);
+      
+      double lambda = 0.0;
+      if (y(r, k) == 1) {
+        lambda = f(mu);
+        w(r, k) = lambda * (lambda + mu);
+      } else if (y(r, k) == 0) {
+        lambda = g(mu);
+        w(r, k) = lambda * (lambda - mu);
+      } else {
+        w(r, k) = 0.0;
+      } // end if
+    } // end for (k)
+  } // end for (r)
+  
+  info->zeros(p, p, y_cols);
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < tiles * y_cols; t++) {
+    const int k = t / tiles;
+    const int a0 = (t % tiles) * INFO_TILE;
+    const int a1 = std::min(a0 + INFO_TILE, p);
+    const double* wk = w.colptr(k);
+    
+    // Lower triangle only, mirrored below
+    for (int r0 = 0; r0 < n; r0 += INFO_ROWS) {
+      const int r1 = std::min(r0 + INFO_ROWS, n);
+      for (int a = a0; a < a1; a++) {
+        const double* xa = x.colptr(a);
+        for (int b = 0; b <= a; b++) {
+          const double* xb = x.colptr(b);
+          double sum = 0.0;
+          for (int r = r0; r < r1; r++)
+            sum += xa[r] * wk[r] * xb[r];
+          (*info)(a, b, k) += sum;
+        } // end for (b)
+      } // end for (a)
+    } // end for (r0)
+  } // end for (t)
+  
+  for (int k = 0; k < y_cols; k++)
+    for (int a = 0; a < p; a++)
+      for (int b = 0; b < a; b++)
+        (*info)(b, a, k) = (*info)(a, b, k);
+} // end info_sequential
+
+// Thrown by em_fit when x'x cannot be inverted, so callers can tell a bad
+// design from a failed fit
+struct singular_design : public std::runtime_error {
+  singular_design() : std::runtime_error("x'x is singular") {}
+}; // end singular_design
+
+// Runs a full fit on whichever backend is selected; touches no R objects
+// so it can run on a background thread. With vcov, the backend that ran
+// the fit also makes one more pass for the observed information and vcov
+// gets its inverse for each outcome (p x p x k). eystar is only filled in
+// when given.
+void em_fit(const arma::mat& y, const arma::mat& x, const int max_iter, bool async,
+            arma::mat* beta, arma::mat* eystar = NULL, em_control* control = NULL,
+            em_trace* trace = NULL, arma::cube* vcov = NULL) {
+  // Initialize outputs (one column per outcome in y)
+  beta->zeros(x.n_cols, y.n_cols);
+  if (eystar)
+    eystar->zeros(x.n_rows, y.n_cols);
+  
+  // Do some matrix stuff up front
+  arma::mat xtx_inv;
+  if (!arma::inv(xtx_inv, x.t() * x))
+    throw singular_design();
+  
+  // implement algorithm (the device M-step works from z = (x'x)^-1 x')
+  arma::cube info;
+  if (async) {
+    const arma::mat z = xtx_inv * x.t();
+    em_parallel(x, y, z, max_iter, beta, eystar, control, trace, vcov ? &info : NULL);
+  } else {
+    // The sequential E-step needs somewhere to work even if not kept
+    arma::mat work;
+    if (!eystar)
+      work.zeros(x.n_rows, y.n_cols);
+    em_sequential(x, y, xtx_inv, max_iter, beta, eystar ? eystar : &work, control, trace);
+    if (vcov)
+      info_sequential(x, y, *beta, &info);
+  } // end if
+  
+  // Invert the information; an outcome whose information is not positive
+  // definite keeps its fit but gets a NaN vcov
+  if (vcov) {
+    vcov->set_size(info.n_rows, info.n_cols, info.n_slices);
+    for (int k = 0; k < info.n_slices; k++) {
+      arma::mat slice_inv;
+      if (arma::inv_sympd(slice_inv, info.slice(k)))
+        vcov->slice(k) = slice_inv;
+      else
+        vcov->slice(k).fill(arma::datum::nan);
+    } // end for (k)
+  } // end if
+} // end em_fit
+
+// Mean and variance of y* ~ N(mu, sigma^2) truncated to [l, u]: l == u is
+// an observed value and infinite bounds are open ends. So far into a tail
+// that its probability underflows, y* is put at the nearest bound.
+void censored_moments(const double mu, const double sigma, const double l, const double u,
+                      double* mean, double* var) {
+  if (l == u) {
+    *mean = l;
+    *var = 0.0;
+    return;
+  } // end if
+  
+  const double a = (l - mu) / sigma;
+  const double b = (u - mu) / sigma;
+  const double da = std::isinf(a) ? 0.0 : R::dnorm(a, 0, 1, false);
+  const double db = std::isinf(b) ? 0.0 : R::dnorm(b, 0, 1, false);
+  const double z = a > 0 ? R::pnorm(a, 0, 1, false, false) - R::pnorm(b, 0, 1, false, false)
+                         : R::pnorm(b, 0, 1, true, false) - R::pnorm(a, 0, 1, true, false);
+  if (z <= 0.0) {
+    *mean = std::isinf(u) ? l : std::isinf(l) ? u : (l + u) / 2;
+    *var = 0.0;
+    return;
+  } // end if
+  
+  const double lambda = (da - db) / z;
+  const double shape = ((std::isinf(a) ? 0.0 : a * da) - (std::isinf(b) ? 0.0 : b * db)) / z;
+  *mean = mu + (sigma * lambda);
+  *var = sigma * sigma * std::max(1 + shape - (lambda * lambda), 0.0);
+} // end censored_moments
+
+// The censored normal expectation step: E[y*] and Var(y*) for every
+// (row, outcome) given mu = x * beta and each outcome's sigma
+void censored_expectation(const arma::mat& mu, const arma::mat& lower, const arma::mat& upper,
+                          const arma::rowvec& sigma, arma::mat* eystar, arma::mat* evar) {
+  for (int k = 0; k < lower.n_cols; k++)
+    for (int r = 0; r < lower.n_rows; r++)
+      censored_moments(mu(r, k), sigma(k), lower(r, k), upper(r, k), &(*eystar)(r, k), &(*evar)(r, k));
+} // end censored_expectation
+
+// Log likelihood of each outcome of a censored normal fit: the density at
+// observed rows and the probability of [lower, upper] at censored ones
+arma::rowvec censored_loglik(const arma::mat& x, const arma::mat& lower, const arma::mat& upper,
+                             const arma::mat& beta, const arma::rowvec& sigma) {
+  const arma::mat mu = x * beta;
+  arma::rowvec ll(lower.n_cols);
+  ll.fill(0.0);
+  for (int k = 0; k < lower.n_cols; k++) {
+    for (int r = 0; r < lower.n_rows; r++) {
+      const double l = lower(r, k);
+      const double u = upper(r, k);
+      const double a = (l - mu(r, k)) / sigma(k);
+      const double b = (u - mu(r, k)) / sigma(k);
+      if (l == u)
+        ll(k) += R::dnorm(l, mu(r, k), sigma(k), true);
+      else if (std::isinf(u))
+        ll(k) += R::pnorm(a, 0, 1, false, true);
+      else if (std::isinf(l))
+        ll(k) += R::pnorm(b, 0, 1, true, true);
+      else if (a > 0)
+        ll(k) += std::log(R::pnorm(a, 0, 1, false, false) - R::pnorm(b, 0, 1, false, false));
+      else
+        ll(k) += std::log(R::pnorm(b, 0, 1, true, false) - R::pnorm(a, 0, 1, true, false));
+    } // end for (r)
+  } // end for (k)
+  
+  return ll;
+} // end censored_loglik
+
+// Censored normal EM on the host. Each iteration is one E-step at mu, the
+// usual M-step for beta and then mu = x * beta at the new beta, which
+// gives sigma^2 = mean((E[y*] - mu)^2 + Var(y*)) and is reused by the next
+// E-step, so there is still one pass over x per iteration. Both sums use
+// the fixed shape reduction.
+void tobit_sequential(const arma::mat& x, const arma::mat& lower, const arma::mat& upper,
+                      const arma::mat& xtx_inv, const int max_iter, arma::mat* beta,
+                      arma::rowvec* sigma, arma::mat* eystar) {
+  const int n = x.n_rows;
+  arma::mat mu = x * (*beta);
+  arma::mat xte(x.n_cols, lower.n_cols);
+  arma::mat evar(n, lower.n_cols);
+  arma::vec ones(n);
+  ones.fill(1.0);
+  
+  // Iterations
+  for (int i = 0; i < max_iter; i++) {
+    censored_expectation(mu, lower, upper, *sigma, eystar, &evar);
+    
+    // maximization step
+    reduce_crossprod(x, *eystar, &xte);
+    normal_solve(xtx_inv, xte, beta);
+    mu = x * (*beta);
+    for (int k = 0; k < lower.n_cols; k++) {
+      for (int r = 0; r < n; r++) {
+        const double d = (*eystar)(r, k) - mu(r, k);
+        evar(r, k) += d * d;
+      } // end for (r)
+      (*sigma)(k) = std::sqrt(reduce_dot(evar.colptr(k), ones.memptr(), n) / n);
+    } // end for (k)
+  } // end for
+} // end tobit_sequential
+
+// Censored normal EM on the device, in the same order as tobit_sequential:
+// the expectation kernel, the beta reduction, then the residual kernel
+// leaves mu for the next iteration and its reduction n * sigma^2. Nothing
+// comes back until the end; eystar may be NULL as in em_parallel.
+void tobit_parallel(const arma::mat& x, const arma::mat& lower, const arma::mat& upper,
+                    const arma::mat& z, const int max_iter, arma::mat* beta,
+                    arma::rowvec* sigma, arma::mat* eystar) {
+  std::lock_guard<std::mutex> device_lock(device_mutex);
+  queue_drain drain;
+  
+  // Get the dimensions
+  const int x_rows = x.n_rows;
+  const int y_cols = lower.n_cols;
+  const size_t y_bytes = sizeof(float) * (x_rows * y_cols);
+  const size_t sigma_bytes = sizeof(float) * y_cols;
+  
+  // Start from mu at the initial beta and its n * sigma^2
+  const arma::mat mu = x * (*beta);
+  arma::mat sigma_sum(1, y_cols);
+  for (int k = 0; k < y_cols; k++)
+    sigma_sum(0, k) = x_rows * (*sigma)(k) * (*sigma)(k);
+  
+  // Load the OpenCL device stuff (kept loaded, with its queue, between fits)
+  load_kernel();
+  
+  // Upload the data (the host arrays stay put until the queue has finished)
+  device_design design(x, z, *beta);
+  host_lease<float> lower_fl(y_bytes);
+  host_lease<float> upper_fl(y_bytes);
+  host_lease<float> mu_fl(y_bytes);
+  host_lease<float> sigma_fl(sigma_bytes);
+  host_lease<float> eystar_fl(y_bytes);
+  device_lease lower_in(y_bytes);
+  device_lease upper_in(y_bytes);
+  device_lease mu_io(y_bytes);
+  device_lease sigma_io(sigma_bytes);
+  device_lease eystar_io(y_bytes);
+  device_lease evar_io(y_bytes);
+  upload(lower, lower_fl, lower_in);
+  upload(upper, upper_fl, upper_in);
+  upload(mu, mu_fl, mu_io);
+  upload(sigma_sum, sigma_fl, sigma_io);
+  
+  // Set scalar memory
+  const cl_int x_cols_in = design.x_cols;
+  const cl_int x_rows_in = x_rows;
+  
+  // Set the parameters
+  // -- expectation
+  clSetKernelArg(censored_exp_kernel, 0, sizeof(cl_mem), &lower_in.mem);
+  clSetKernelArg(censored_exp_kernel, 1, sizeof(cl_mem), &upper_in.mem);
+  clSetKernelArg(censored_exp_kernel, 2, sizeof(cl_mem), &mu_io.mem);
+  clSetKernelArg(censored_exp_kernel, 3, sizeof(cl_mem), &sigma_io.mem);
+  clSetKernelArg(censored_exp_kernel, 4, sizeof(cl_mem), &eystar_io.mem);
+  clSetKernelArg(censored_exp_kernel, 5, sizeof(cl_mem), &evar_io.mem);
+  clSetKernelArg(censored_exp_kernel, 6, sizeof(cl_int), &x_rows_in);
+  // -- M-step
+  design.bind_mstep(eystar_io);
+  // -- residuals
+  clSetKernelArg(censored_resid_kernel, 0, sizeof(cl_mem), &design.x_in.mem);
+  clSetKernelArg(censored_resid_kernel, 1, sizeof(cl_mem), &design.beta_io.mem);
+  clSetKernelArg(censored_resid_kernel, 2, sizeof(cl_mem), &eystar_io.mem);
+  clSetKernelArg(censored_resid_kernel, 3, sizeof(cl_mem), &evar_io.mem);
+  clSetKernelArg(censored_resid_kernel, 4, sizeof(cl_mem), &mu_io.mem);
+  clSetKernelArg(censored_resid_kernel, 5, sizeof(cl_int), &x_cols_in);
+  clSetKernelArg(censored_resid_kernel, 6, sizeof(cl_int), &x_rows_in);
+  // -- n * sigma^2
+  bind_reducer(sigma_reduce, evar_io, sigma_io, x_rows, REDUCE_BLOCK);
+  
+  // Queue up the kernels for execution
+  const size_t exp_dims[] = {(size_t)x_rows, (size_t)y_cols};
+  for (int i = 0; i < max_iter; i++) {
+    clEnqueueNDRangeKernel(queue, censored_exp_kernel, 2, NULL, exp_dims, NULL, 0, NULL, NULL);
+    design.enqueue_mstep(y_cols, NULL);
+    clEnqueueNDRangeKernel(queue, censored_resid_kernel, 2, NULL, exp_dims, NULL, 0, NULL, NULL);
+    enqueue_reduce(sigma_reduce, x_rows, y_cols, NULL);
+  } // end for
+  
+  // Execute
+  clFlush(queue);
+  clFinish(queue);
+  
+  // Read out our results
+  download(design.beta_io, design.beta_fl, beta, "beta");
+  download(sigma_io, sigma_fl, &sigma_sum, "sigma");
+  for (int k = 0; k < y_cols; k++)
+    (*sigma)(k) = std::sqrt(sigma_sum(0, k) / x_rows);
+  if (eystar)
+    download(eystar_io, eystar_fl, eystar, "eystar");
+} // end tobit_parallel
+
+// Runs a censored normal fit on whichever backend is selected, starting
+// from least squares on a single value per row (the observed value, the
+// censoring time or the midpoint of the interval). eystar is only filled
+// in when given.
+void tobit_fit(const arma::mat& lower, const arma::mat& upper, const arma::mat& x,
+               const int max_iter, bool async, arma::mat* beta, arma::rowvec* sigma,
+               arma::mat* eystar = NULL) {
+  const int n = x.n_rows;
+  
+  // Do some matrix stuff up front
+  arma::mat xtx_inv;
+  if (!arma::inv(xtx_inv, x.t() * x))
+    throw std::runtime_error("x'x is singular");
+  
+  // Starting values
+  arma::mat y0(n, lower.n_cols);
+  for (int k = 0; k < lower.n_cols; k++) {
+    for (int r = 0; r < n; r++) {
+      const double l = lower(r, k);
+      const double u = upper(r, k);
+      y0(r, k) = std::isinf(u) ? (std::isinf(l) ? 0.0 : l) : std::isinf(l) ? u : (l + u) / 2;
+    } // end for (r)
+  } // end for (k)
+  *beta = xtx_inv * (x.t() * y0);
+  const arma::mat resid = y0 - (x * (*beta));
+  sigma->set_size(lower.n_cols);
+  for (int k = 0; k < lower.n_cols; k++) {
+    (*sigma)(k) = std::sqrt(arma::dot(resid.col(k), resid.col(k)) / n);
+    if ((*sigma)(k) == 0.0)
+      (*sigma)(k) = 1.0;
+  } // end for (k)
+  
+  // implement algorithm
+  if (eystar)
+    eystar->zeros(n, lower.n_cols);
+  if (async) {
+    const arma::mat z = xtx_inv * x.t();
+    tobit_parallel(x, lower, upper, z, max_iter, beta, sigma, eystar);
+  } else {
+    // The sequential E-step needs somewhere to work even if not kept
+    arma::mat work;
+    if (!eystar)
+      work.zeros(n, lower.n_cols);
+    tobit_sequential(x, lower, upper, xtx_inv, max_iter, beta, sigma, eystar ? eystar : &work);
+  } // end if
+} // end tobit_fit
+
+// Converts a trace to a data frame, oldest iteration first. Times are in
+// seconds (device time on the OpenCL path) and loglik is at the beta the
+// iteration started from.
+DataFrame trace_frame(const em_trace& trace) {
+  const int rows = std::min(trace.count, trace.capacity);
+  const int first = trace.count > trace.capacity ? trace.count % trace.capacity : 0;
+  
+  IntegerVector iter(rows);
+  NumericVector seconds(rows), estep(rows), mstep(rows), delta(rows), loglik(rows);
+  for (int r = 0; r < rows; r++) {
+    const int slot = (first + r) % trace.capacity;
+    iter[r] = trace.iter[slot];
+    seconds[r] = trace.seconds[slot];
+    estep[r] = trace.estep[slot];
+    mstep[r] = trace.mstep[slot];
+    delta[r] = trace.delta[slot];
+    loglik[r] = trace.loglik[slot];
+  } // end for
+  
+  return DataFrame::create(Named("iter") = iter, Named("seconds") = seconds,
+                           Named("estep") = estep, Named("mstep") = mstep,
+                           Named("delta") = delta, Named("loglik") = loglik);
+} // end trace_frame
+
+// Fits the probit EM model; y may be an n x k matrix of outcomes that all
+// share the design matrix x, in which case beta is returned as p x k.
+// Only beta is returned by default; keep_eystar adds E[y*] (n x k, which
+// survivalPredict can also recompute later from beta), a positive trace
+// keeps timings for that many of the last iterations, and se adds the
+// variance-covariance matrix of beta (p x p x k) and its standard errors
+// (p x k), both NA for an outcome whose observed information is not
+// positive definite.
 // [[Rcpp::export]]
-List survivalEM(const arma::mat y,  arma::mat x, // input
-                const int max_iter, bool async) {
+List survivalEM(const arma::mat y, const arma::mat x, // input
+                const int max_iter, bool async, const int trace = 0,
+                const bool se = false, const bool keep_eystar = false) {
   // Check if the vectors are the same size
   if (y.n_rows != x.n_rows)
     stop("matrices not the same length");
   
-  // Initialize outputs
-  arma::mat beta(x.n_cols, 1);
-  arma::mat eystar(x.n_rows, 1);
-  beta.fill(0.0); 
-  eystar.fill(0.0); 
-  
-  // Do some matrix stuff up front
-  arma::mat z = (x.t() * x).i() * x.t();
-  
   // implement algorithm
-  if (async)
-    em_parallel(&x, y, z, max_iter, &beta, &eystar);
-  else
-    em_sequential(x, y, z, max_iter, &beta, &eystar);
+  arma::mat beta, eystar;
+  arma::cube vcov;
+  std::unique_ptr<em_trace> em_tr(trace > 0 ? new em_trace(trace) : NULL);
+  em_fit(y, x, max_iter, async, &beta, keep_eystar ? &eystar : NULL, NULL, em_tr.get(),
+         se ? &vcov : NULL);
   
   // Output betas
   if (DEBUG) {
-    for (int b = 0; b < x.n_cols; b++)
+    for (int k = 0; k < y.n_cols; k++)
+      for (int b = 0; b < x.n_cols; b++)
+        if (async)
+          Rcout << "par - beta " << b << "," << k << ": " << beta(b, k) << std::endl;
+        else
+          Rcout << "seq - beta " << b << "," << k << ": " << beta(b, k) << std::endl;
+  } // end if
+  
+  // Return list
+  List out;
+  out["beta"] = beta;
+  if (keep_eystar)
+    out["eystar"] = eystar;
+  if (em_tr)
+    out["trace"] = trace_frame(*em_tr);
+  if (se) {
+    arma::mat std_err(beta.n_rows, beta.n_cols);
+    for (int k = 0; k < vcov.n_slices; k++) {
+      if (!vcov.slice(k).is_finite())
+        vcov.slice(k).fill(NA_REAL);
+      for (int b = 0; b < vcov.n_rows; b++)
+        std_err(b, k) = R_IsNA(vcov(b, b, k)) ? NA_REAL : std::sqrt(vcov(b, b, k));
+    } // end for (k)
+    out["vcov"] = vcov;
+    out["se"] = std_err;
+  } // end if
+  
+  return out;
+} // end survivalEM
+
+// Fits the censored normal (Tobit) model y* ~ N(x * beta, sigma^2) by EM.
+// Each row of y is given by its bounds: lower == upper for an observed
+// value, upper = Inf for right censoring at lower, lower = -Inf for left
+// censoring at upper and finite lower < upper for an interval. As with
+// survivalEM, lower and upper may be n x k with every outcome sharing x.
+// Returns beta (p x k), sigma and the log likelihood for each outcome, and
+// E[y*] (n x k) with keep_eystar.
+// [[Rcpp::export]]
+List survivalTobitEM(const arma::mat lower, const arma::mat upper, const arma::mat x, // input
+                     const int max_iter, bool async, const bool keep_eystar = false) {
+  // Check the inputs
+  if (lower.n_rows != x.n_rows || upper.n_rows != x.n_rows)
+    stop("matrices not the same length");
+  if (lower.n_cols != upper.n_cols)
+    stop("lower and upper must have the same number of outcomes");
+  for (int i = 0; i < lower.n_elem; i++) {
+    if (!(lower(i) <= upper(i)))
+      stop("lower must not be above upper");
+    if (lower(i) == upper(i) && std::isinf(lower(i)))
+      stop("observed values must be finite");
+  } // end for
+  
+  // implement algorithm
+  arma::mat beta, eystar;
+  arma::rowvec sigma;
+  tobit_fit(lower, upper, x, max_iter, async, &beta, &sigma, keep_eystar ? &eystar : NULL);
+  const arma::rowvec loglik = censored_loglik(x, lower, upper, beta, sigma);
+  
+  // Return list
+  List out;
+  out["beta"] = beta;
+  out["sigma"] = NumericVector(sigma.begin(), sigma.end());
+  out["loglik"] = NumericVector(loglik.begin(), loglik.end());
+  if (keep_eystar)
+    out["eystar"] = eystar;
+  
+  return out;
+} // end survivalTobitEM
+
+// Out of fold log likelihood of a probit fit for the rows of y in {0, 1}
+double probit_loglik(const arma::vec& eta, const arma::vec& y) {
+  double ll = 0.0;
+  for (int i = 0; i < y.n_rows; i++) {
+    if (y(i) == 1)
+      ll += R::pnorm(eta(i), 0, 1, true, true);
+    else if (y(i) == 0)
+      ll += R::pnorm(eta(i), 0, 1, false, true);
+  } // end for
+  
+  return ll;
+} // end probit_loglik
+
+// Area under the ROC curve via the Mann-Whitney rank sum (ties get average
+// ranks); rows of y that are not in {0, 1} are ignored
+double probit_auc(const arma::vec& eta, const arma::vec& y) {
+  std::vector<int> idx;
+  for (int i = 0; i < y.n_rows; i++)
+    if (y(i) == 1 || y(i) == 0)
+      idx.push_back(i);
+  std::sort(idx.begin(), idx.end(), [&eta](int a, int b) { return eta(a) < eta(b); });
+  
+  double rank_sum = 0.0, pos = 0.0;
+  for (int i = 0; i < idx.size(); ) {
+    // Find the run of tied predictions
+    int j = i;
+    while (j < idx.size() && eta(idx[j]) == eta(idx[i]))
+      j++;
+    const double rank = (i + j + 1) / 2.0;
+    
+    for (int t = i; t < j; t++) {
+      if (y(idx[t]) == 1) {
+        rank_sum += rank;
+        pos++;
+      } // end if
+    } // end for (t)
+    i = j;
+  } // end for (i)
+  
+  const double neg = idx.size() - pos;
+  if (pos == 0 || neg == 0)
+    return NA_REAL;
+  
+  return (rank_sum - (pos * (pos + 1) / 2)) / (pos * neg);
+} // end probit_auc
+
+// Runs k-fold cross validation; folds gives the fold (1..K) of each row
+// and every fold must hold at least one row. x'x is formed once and each
+// fold's normal matrix is downdated by its held out block; on the host the
+// M-step works straight from its inverse, so per fold only the p x p
+// inverse is new (the device still needs the p x n z for each fold). The
+// folds are fit concurrently (on the device they are fit one after
+// another since they share the queue)
+// [[Rcpp::export]]
+List survivalCV(const arma::mat y, const arma::mat x, const IntegerVector folds, // input
+                const int max_iter, bool async) {
+  // Check the inputs
+  if (y.n_rows != x.n_rows)
+    stop("matrices not the same length");
+  if (folds.length() != x.n_rows)
+    stop("folds not the same length as the data");
+  
+  int n_folds = 0;
+  for (int i = 0; i < folds.length(); i++) {
+    if (folds[i] < 1)
+      stop("folds must be numbered from 1");
+    n_folds = std::max(n_folds, (int)folds[i]);
+  } // end for
+  
+  // Split the rows up by fold
+  std::vector<std::vector<arma::uword> > held(n_folds), train(n_folds);
+  for (int i = 0; i < x.n_rows; i++)
+    for (int f = 0; f < n_folds; f++)
+      (folds[i] == f + 1 ? held[f] : train[f]).push_back(i);
+  for (int f = 0; f < n_folds; f++)
+    if (held[f].empty())
+      stop("fold " + std::to_string(f + 1) + " has no rows");
+  
+  // The full normal matrix, shared by every fold
+  const arma::mat xtx = x.t() * x;
+  
+  // Initialize outputs
+  arma::cube beta(x.n_cols, y.n_cols, n_folds);
+  arma::mat loglik(n_folds, y.n_cols);
+  arma::mat auc(n_folds, y.n_cols);
+  IntegerVector n_held(n_folds);
+  std::vector<std::string> errors(n_folds);
+  beta.fill(0.0);
+  for (int f = 0; f < n_folds; f++)
+    n_held[f] = held[f].size();
+  
+  #pragma omp parallel for schedule(dynamic) if (!async)
+  for (int f = 0; f < n_folds; f++) {
+    try {
+      const arma::uvec held_rows(held[f]);
+      const arma::uvec train_rows(train[f]);
+      const arma::mat x_held = x.rows(held_rows);
+      const arma::mat x_train = x.rows(train_rows);
+      const arma::mat y_train = y.rows(train_rows);
+      
+      // Downdate x'x by the held out rows
+      const arma::mat xtx_inv = arma::inv_sympd(xtx - (x_held.t() * x_held));
+      
+      // implement algorithm (eystar is only kept on the host path, where
+      // the E-step works in it)
+      arma::mat b(x.n_cols, y.n_cols);
+      arma::mat eystar(train_rows.n_elem, y.n_cols);
+      b.fill(0.0);
+      eystar.fill(0.0);
       if (async)
-        Rcout << "par - beta " << b << ": " << beta(b, 0) << std::endl;
+        em_parallel(x_train, y_train, xtx_inv * x_train.t(), max_iter, &b, NULL);
       else
-        Rcout << "seq - beta " << b << ": " << beta(b, 0) << std::endl;
-  } // end if
+        em_sequential(x_train, y_train, xtx_inv, max_iter, &b, &eystar);
+      
+      // Score the held out rows
+      const arma::mat eta = x_held * b;
+      const arma::mat y_held = y.rows(held_rows);
+      for (int k = 0; k < y.n_cols; k++) {
+        loglik(f, k) = probit_loglik(eta.col(k), y_held.col(k));
+        auc(f, k) = probit_auc(eta.col(k), y_held.col(k));
+      } // end for (k)
+      beta.slice(f) = b;
+    } catch (std::exception& e) {
+      errors[f] = e.what();
+    } // end try
+  } // end for (f)
+  
+  // Report the first failed fold
+  for (int f = 0; f < n_folds; f++)
+    if (!errors[f].empty())
+      stop("fold " + std::to_string(f + 1) + ": " + errors[f]);
   
   // Return list
   List out;
-  out["y"] = y;
-  out["x"] = x;
   out["beta"] = beta;
-  out["eystar"] = eystar;
+  out["loglik"] = loglik;
+  out["auc"] = auc;
+  out["n"] = n_held;
+  
+  return out;
+} // end survivalCV
+
+// One coordinate descent sweep over cols for a single outcome, minimizing
+// (1/2n)||eystar - x * beta||^2 + sum_j pen_j * (l1 * |beta_j| + (l2 / 2) * beta_j^2)
+// with pen_j 0 for unpenalized columns and 1 otherwise.
+// r = eystar - mu and mu = x * beta are kept current as beta moves, so
+// coefficients that stay at zero cost nothing beyond their inner product.
+// Returns the largest change in beta.
+double cd_sweep(const arma::mat& x, const arma::vec& xs, const std::vector<int>& cols,
+                const std::vector<double>& pen, const double l1, const double l2,
+                double* beta, double* mu, double* r) {
+  const int n = x.n_rows;
+  double delta = 0.0;
+  
+  for (int c = 0; c < cols.size(); c++) {
+    const int j = cols[c];
+    const double* xj = x.colptr(j);
+    
+    // Partial residual correlation
+    double rho = 0.0;
+    for (int i = 0; i < n; i++)
+      rho += xj[i] * r[i];
+    rho = (rho / n) + (xs(j) * beta[j]);
+    
+    // Soft threshold
+    const double t1 = l1 * pen[j];
+    const double t2 = l2 * pen[j];
+    double next = 0.0;
+    if (rho > t1)
+      next = (rho - t1) / (xs(j) + t2);
+    else if (rho < -t1)
+      next = (rho + t1) / (xs(j) + t2);
+    
+    const double step = next - beta[j];
+    if (step != 0.0) {
+      for (int i = 0; i < n; i++) {
+        r[i] -= xj[i] * step;
+        mu[i] += xj[i] * step;
+      } // end for (i)
+      beta[j] = next;
+      delta = std::max(delta, std::abs(step));
+    } // end if
+  } // end for (c)
+  
+  return delta;
+} // end cd_sweep
+
+// Fits a path of penalized models, one per value of lambda (fit in the
+// given order, largest first for the best warm starts). The penalty is
+// lambda * (alpha * |beta| + (1 - alpha) / 2 * ||beta||^2) on the
+// (1/2n) scaled M-step least squares, applied to x on its raw scale (the
+// columns are not standardized). unpenalized gives the columns (from 1)
+// left out of the penalty; by default that is any constant column, i.e.
+// an intercept. alpha = 0 is ridge, which reuses a single thin SVD of the
+// penalized columns (less their fit on the unpenalized ones) for every
+// lambda; otherwise the M-step is a warm started coordinate descent sweep
+// over the working response eystar.
+// [[Rcpp::export]]
+List survivalPenalizedEM(const arma::mat y, const arma::mat x, // input
+                         const int max_iter, const NumericVector lambda,
+                         const double alpha = 0.0, const double tol = 1e-6,
+                         Nullable<IntegerVector> unpenalized = R_NilValue) {
+  // Check the inputs
+  if (y.n_rows != x.n_rows)
+    stop("matrices not the same length");
+  if (alpha < 0 || alpha > 1)
+    stop("alpha must be between 0 and 1");
+  for (int l = 0; l < lambda.length(); l++)
+    if (lambda[l] < 0)
+      stop("lambda must be non-negative");
+  
+  const int n = x.n_rows;
+  const int p = x.n_cols;
+  const int y_cols = y.n_cols;
+  
+  // Penalty factor of each column
+  std::vector<double> pen(p, 1.0);
+  if (unpenalized.isNotNull()) {
+    const IntegerVector free_cols(unpenalized.get());
+    for (int c = 0; c < free_cols.length(); c++) {
+      if (free_cols[c] < 1 || free_cols[c] > p)
+        stop("unpenalized columns must be between 1 and ncol(x)");
+      pen[free_cols[c] - 1] = 0.0;
+    } // end for (c)
+  } else {
+    for (int j = 0; j < p; j++) {
+      bool constant = n > 0 && x(0, j) != 0;
+      for (int i = 1; i < n && constant; i++)
+        constant = x(i, j) == x(0, j);
+      if (constant)
+        pen[j] = 0.0;
+    } // end for (j)
+  } // end if
+  std::vector<arma::uword> pen_idx, free_idx;
+  for (int j = 0; j < p; j++)
+    (pen[j] > 0 ? pen_idx : free_idx).push_back(j);
+  
+  // Initialize outputs (warm started from one lambda to the next)
+  arma::cube path(p, y_cols, lambda.length());
+  IntegerVector iter(lambda.length());
+  arma::mat beta(p, y_cols);
+  arma::mat eystar(n, y_cols);
+  arma::mat mu(n, y_cols);
+  beta.fill(0.0);
+  eystar.fill(0.0);
+  mu.fill(0.0);
+  
+  if (alpha == 0) {
+    // Ridge on the penalized columns xp less their projection on the
+    // unpenalized ones xu, so with that residual r = U diag(s) V',
+    // b = V diag(s / (s^2 + n * lambda)) U' eystar and then the free
+    // coefficients are the least squares a = (xu'xu)^-1 xu' (eystar - xp b),
+    // taken as (xu'xu)^-1 (xu' eystar - (xu'xp) b) so no iteration forms
+    // an n-length residual
+    const arma::mat xp = x.cols(arma::uvec(pen_idx));
+    const arma::mat xu = x.cols(arma::uvec(free_idx));
+    arma::mat xu_inv, xutxp, r = xp;
+    if (!free_idx.empty()) {
+      if (!arma::inv(xu_inv, xu.t() * xu))
+        stop("unpenalized columns are collinear");
+      xutxp = xu.t() * xp;
+      r = xp - (xu * (xu_inv * xutxp));
+    } // end if
+    
+    arma::mat U, V;
+    arma::vec s;
+    if (!arma::svd_econ(U, s, V, r))
+      stop("svd of x failed");
+    arma::vec d(s.n_rows);
+    arma::mat ute(s.n_rows, y_cols);
+    arma::mat b(pen_idx.size(), y_cols), a(free_idx.size(), y_cols);
+    arma::mat xue(free_idx.size(), y_cols);
+    arma::mat next(p, y_cols);
+    
+    for (int l = 0; l < lambda.length(); l++) {
+      for (int i = 0; i < s.n_rows; i++)
+        d(i) = s(i) > 0 ? s(i) / ((s(i) * s(i)) + (n * lambda[l])) : 0.0;
+      
+      int i = 0;
+      while (i < max_iter) {
+        mu = x * beta;
+        expectation(mu, y, &eystar);
+        
+        // maximization step
+        reduce_crossprod(U, eystar, &ute);
+        ute.each_col() %= d;
+        b = V * ute;
+        if (!free_idx.empty()) {
+          reduce_crossprod(xu, eystar, &xue);
+          xue -= xutxp * b;
+          normal_solve(xu_inv, xue, &a);
+        } // end if
+        for (int k = 0; k < y_cols; k++) {
+          for (int j = 0; j < pen_idx.size(); j++)
+            next(pen_idx[j], k) = b(j, k);
+          for (int j = 0; j < free_idx.size(); j++)
+            next(free_idx[j], k) = a(j, k);
+        } // end for (k)
+        double delta = 0.0;
+        for (int b = 0; b < beta.n_elem; b++)
+          delta = std::max(delta, std::abs(next(b) - beta(b)));
+        beta = next;
+        i++;
+        
+        if (delta < tol)
+          break;
+      } // end while
+      
+      path.slice(l) = beta;
+      iter[l] = i;
+    } // end for (l)
+  } else {
+    // Elastic net: coordinate descent against the column scales x_j'x_j / n
+    const arma::vec xs = arma::sum(arma::square(x), 0).t() / n;
+    arma::mat r(n, y_cols);
+    std::vector<int> all(p);
+    for (int j = 0; j < p; j++)
+      all[j] = j;
+    std::vector<std::vector<int> > active(y_cols, all);
+    
+    for (int l = 0; l < lambda.length(); l++) {
+      const double l1 = lambda[l] * alpha;
+      const double l2 = lambda[l] * (1 - alpha);
+      
+      // Sweep everything on the first iteration and every tenth after
+      // that; in between only the nonzero (active) coefficients move
+      bool full = true;
+      int i = 0;
+      while (i < max_iter) {
+        expectation(mu, y, &eystar);
+        r = eystar - mu;
+        
+        // maximization step
+        double delta = 0.0;
+        for (int k = 0; k < y_cols; k++) {
+          delta = std::max(delta, cd_sweep(x, xs, full ? all : active[k], pen, l1, l2,
+                                           beta.colptr(k), mu.colptr(k), r.colptr(k)));
+          
+          if (full) {
+            active[k].clear();
+            for (int j = 0; j < p; j++)
+              if (beta(j, k) != 0)
+                active[k].push_back(j);
+          } // end if
+        } // end for (k)
+        i++;
+        
+        // Only stop once a full sweep agrees nothing else wants to move
+        if (delta < tol && full)
+          break;
+        full = (delta < tol) || (i % 10 == 0);
+      } // end while
+      
+      path.slice(l) = beta;
+      iter[l] = i;
+    } // end for (l)
+  } // end if
+  
+  // Return list
+  List out;
+  out["beta"] = path;
+  out["lambda"] = lambda;
+  out["iter"] = iter;
+  
+  return out;
+} // end survivalPenalizedEM
+
+// Scores new data with a fitted beta, writing into the preallocated out
+// (a double vector with one element per row of x) rather than allocating.
+// out must already be double: any other type would be coerced to a new
+// vector and the caller's never written, so it is an error. The writes
+// are in place, so they show up through every R binding that shares out
+// (e.g. a copy made with <- that has not been modified since).
+// type is "link" (x * beta), "response" (pnorm(x * beta)) or "eystar"
+// (E[y*] given the observed y; rows where y is not 0 or 1 get x * beta).
+// Rows are processed in chunks so each chunk's linear predictor stays in
+// cache while the columns of x stream past, and chunks run in parallel.
+// [[Rcpp::export]]
+NumericVector survivalPredict(NumericMatrix x, const NumericVector beta, SEXP out, // input
+                              const std::string type = "response",
+                              Nullable<NumericVector> y = R_NilValue,
+                              const int chunk = 4096) {
+  const int n = x.nrow();
+  const int p = x.ncol();
+  
+  // Check the inputs
+  if (TYPEOF(out) != REALSXP)
+    stop("out must be a double vector");
+  NumericVector out_vec(out);
+  if (beta.length() != p)
+    stop("beta not the same length as the columns of x");
+  if (out_vec.length() != n)
+    stop("out not the same length as the rows of x");
+  if (chunk < 1)
+    stop("chunk must be positive");
+  
+  const int mode = type == "link" ? 0 : type == "response" ? 1 : type == "eystar" ? 2 : -1;
+  if (mode < 0)
+    stop("type must be one of link, response or eystar");
+  
+  NumericVector y_in;
+  if (mode == 2) {
+    if (y.isNull())
+      stop("y is required for eystar");
+    y_in = NumericVector(y.get());
+    if (y_in.length() != n)
+      stop("y not the same length as the rows of x");
+  } // end if
+  
+  const double* x_ptr = x.begin();
+  const double* b_ptr = beta.begin();
+  const double* y_ptr = mode == 2 ? y_in.begin() : NULL;
+  double* o_ptr = out_vec.begin();
+  const int n_chunks = (n + chunk - 1) / chunk;
+  
+  #pragma omp parallel for schedule(static)
+  for (int c = 0; c < n_chunks; c++) {
+    const int start = c * chunk;
+    const int end = std::min(start + chunk, n);
+    
+    // Linear predictor, accumulated in place a column at a time
+    for (int i = start; i < end; i++)
+      o_ptr[i] = 0.0;
+    for (int j = 0; j < p; j++) {
+      const double b = b_ptr[j];
+      if (b == 0.0)
+        continue;
+      const double* xj = x_ptr + ((size_t)j * n);
+      for (int i = start; i < end; i++)
+        o_ptr[i] += xj[i] * b;
+    } // end for (j)
+    
+    // Transform
+    if (mode == 1) {
+      for (int i = start; i < end; i++)
+        o_ptr[i] = 0.5 * std::erfc(-o_ptr[i] * M_SQRT1_2);
+    } else if (mode == 2) {
+      for (int i = start; i < end; i++) {
+        if (y_ptr[i] == 1)
+          o_ptr[i] = o_ptr[i] + f(o_ptr[i]);
+        else if (y_ptr[i] == 0)
+          o_ptr[i] = o_ptr[i] - g(o_ptr[i]);
+      } // end for (i)
+    } // end if
+  } // end for (c)
+  
+  return out_vec;
+} // end survivalPredict
+
+// A fit running on a background thread. The job owns copies of its inputs
+// and outputs; R only sees it through an external pointer whose finalizer
+// cancels and joins the thread.
+struct em_job {
+  arma::mat y, x, beta, eystar;
+  int max_iter;
+  bool device, keep_eystar;
+  em_control control;
+  std::unique_ptr<em_trace> trace;
+  std::atomic<bool> done;
+  std::string error;
+  std::thread worker;
+  
+  em_job(const arma::mat& y_in, const arma::mat& x_in, int max_iter_in, bool device_in,
+         int trace_in, bool keep_eystar_in)
+    : y(y_in), x(x_in), max_iter(max_iter_in), device(device_in), keep_eystar(keep_eystar_in),
+      trace(trace_in > 0 ? new em_trace(trace_in) : NULL), done(false) {}
+  
+  ~em_job() {
+    control.cancel = true;
+    if (worker.joinable())
+      worker.join();
+  } // end ~em_job
+  
+  void run() {
+    try {
+      em_fit(y, x, max_iter, device, &beta, keep_eystar ? &eystar : NULL, &control, trace.get());
+    } catch (std::exception& e) {
+      error = e.what();
+    } // end try
+    done = true;
+  } // end run
+}; // end em_job
+
+// Gets the job behind a handle from survivalEMAsync
+em_job* get_job(SEXP handle) {
+  em_job* job = XPtr<em_job>(handle).get();
+  if (job == NULL)
+    stop("invalid fit handle");
+  
+  return job;
+} // end get_job
+
+// Starts survivalEM on a background thread and returns a handle for
+// survivalPoll, survivalProgress, survivalCancel and survivalWait. The fit
+// always runs in the background; device selects the OpenCL backend (the
+// async argument of survivalEM), whose work is then queued from that
+// thread, so R is never blocked.
+// [[Rcpp::export]]
+SEXP survivalEMAsync(const arma::mat y, const arma::mat x, // input
+                     const int max_iter, bool device, const int trace = 0,
+                     const bool keep_eystar = false) {
+  // Check if the vectors are the same size
+  if (y.n_rows != x.n_rows)
+    stop("matrices not the same length");
+  
+  em_job* job = new em_job(y, x, max_iter, device, trace, keep_eystar);
+  job->worker = std::thread(&em_job::run, job);
+  
+  return XPtr<em_job>(job, true);
+} // end survivalEMAsync
+
+// Whether the fit has finished (including cancelled or failed)
+// [[Rcpp::export]]
+bool survivalPoll(SEXP handle) {
+  return get_job(handle)->done;
+} // end survivalPoll
+
+// Iterations completed so far
+// [[Rcpp::export]]
+int survivalProgress(SEXP handle) {
+  return get_job(handle)->control.iter;
+} // end survivalProgress
+
+// Asks the fit to stop after its current iteration (or block of
+// iterations on the device); does not wait for it
+// [[Rcpp::export]]
+void survivalCancel(SEXP handle) {
+  get_job(handle)->control.cancel = true;
+} // end survivalCancel
+
+// Blocks until the fit finishes and returns the same list as survivalEM,
+// plus the iterations run and whether it was cancelled. Stays responsive
+// to user interrupts while waiting (the fit keeps running).
+// [[Rcpp::export]]
+List survivalWait(SEXP handle) {
+  em_job* job = get_job(handle);
+  while (!job->done) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    checkUserInterrupt();
+  } // end while
+  if (job->worker.joinable())
+    job->worker.join();
+  
+  if (!job->error.empty())
+    stop(job->error);
+  
+  // Return list
+  List out;
+  out["beta"] = job->beta;
+  if (job->keep_eystar)
+    out["eystar"] = job->eystar;
+  out["iter"] = (int)job->control.iter;
+  out["cancelled"] = job->control.iter < job->max_iter;
+  if (job->trace)
+    out["trace"] = trace_frame(*job->trace);
+  
+  return out;
+} // end survivalWait
+
+// Hit/miss counts of the buffer pool and the bytes it is holding on to
+// [[Rcpp::export]]
+List survivalPoolStats() {
+  std::lock_guard<std::mutex> guard(pool.lock);
+  double host_cached = 0, device_cached = 0;
+  for (std::map<size_t, std::vector<void*> >::iterator it = pool.host_free.begin(); it != pool.host_free.end(); it++)
+    host_cached += (double)it->first * it->second.size();
+  for (std::map<size_t, std::vector<cl_mem> >::iterator it = pool.device_free.begin(); it != pool.device_free.end(); it++)
+    device_cached += (double)it->first * it->second.size();
+  
+  // Return list
+  List out;
+  out["host_hits"] = (double)pool.host_hits;
+  out["host_misses"] = (double)pool.host_misses;
+  out["host_cached"] = host_cached;
+  out["device_hits"] = (double)pool.device_hits;
+  out["device_misses"] = (double)pool.device_misses;
+  out["device_cached"] = device_cached;
   
   return out;
-} // end survivalEM
\ No newline at end of file
+} // end survivalPoolStats
+
+// Frees the pooled buffers and releases the OpenCL device, waiting for any
+// fit that is using it
+// [[Rcpp::export]]
+void survivalRelease() {
+  std::lock_guard<std::mutex> device_lock(device_mutex);
+  release_kernel();
+  pool.clear_host();
+} // end survivalRelease
+
+// Counter based generator: the uniform for (seed, stream, counter) is a
+// hash of the three (splitmix64 finalizer), so a replicate's draws are the
+// same whichever thread makes them and in whatever order
+double counter_uniform(uint64_t seed, uint64_t stream, uint64_t counter) {
+  uint64_t z = seed + (stream * 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+  z += counter * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+  
+  // 53 random bits, centered so it is never 0 or 1
+  return ((double)(z >> 11) + 0.5) / 9007199254740992.0;
+} // end counter_uniform
+
+// Standard normal for (seed, stream, counter) by Box-Muller
+double counter_normal(uint64_t seed, uint64_t stream, uint64_t counter) {
+  const double u1 = counter_uniform(seed, stream, 2 * counter);
+  const double u2 = counter_uniform(seed, stream, (2 * counter) + 1);
+  return std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * M_PI * u2);
+} // end counter_normal
+
+// Monte Carlo study of the probit EM fit. Each replicate draws n rows of x
+// with equicorrelated (rho) standard normal columns, after a column of ones
+// when intercept, and y = 1(x * beta + e > 0), then fits it with the chosen
+// backend and keeps beta and its standard errors. Replicates run across
+// threads, each reusing its own x and y (device fits take turns and reuse
+// the pooled buffers). Only the summary per coefficient is returned: the
+// mean estimate, bias, RMSE, empirical SD, mean standard error and
+// coverage of the level confidence interval, over the replicates that fit.
+// A replicate is left out when its design is singular, when the fitted
+// beta classifies every row correctly (complete separation, so the MLE
+// does not exist), when any |beta| is over beta_max (the drift of a
+// quasi-separated fit) or when a standard error is not finite; any other
+// failure to fit stops with the error of the first replicate it hit.
+// [[Rcpp::export]]
+DataFrame survivalSimulate(const int n, const NumericVector beta, const double rho, // input
+                           const int reps, const int max_iter, bool async = false,
+                           const bool intercept = true, const double seed = 1,
+                           const double level = 0.95, const double beta_max = 10) {
+  const int p = beta.length();
+  const int first = intercept ? 1 : 0;
+  
+  // Check the inputs
+  if (n <= p)
+    stop("n must be larger than the number of coefficients");
+  if (reps < 1)
+    stop("reps must be positive");
+  if (rho < 0 || rho >= 1)
+    stop("rho must be in [0, 1)");
+  if (intercept && p < 2)
+    stop("beta must have the intercept and at least one slope");
+  if (!(seed >= 0 && seed < 18446744073709551616.0 && seed == std::floor(seed)))
+    stop("seed must be a whole number in [0, 2^64)");
+  if (!(level > 0 && level < 1))
+    stop("level must be in (0, 1)");
+  if (!(beta_max > 0))
+    stop("beta_max must be positive");
+  
+  const arma::vec truth(beta.begin(), p);
+  const double crit = R::qnorm(0.5 + (level / 2), 0, 1, true, false);
+  const uint64_t key = (uint64_t)seed;
+  
+  // Per replicate results
+  arma::mat est(p, reps), std_err(p, reps);
+  std::vector<char> ok(reps, 0);
+  std::vector<std::string> errors(reps);
+  
+  #pragma omp parallel
+  {
+    // Buffers for this thread, reused by each of its replicates
+    arma::mat x(n, p), y(n, 1), b;
+    arma::cube vcov;
+    
+    #pragma omp for schedule(dynamic)
+    for (int r = 0; r < reps; r++) {
+      // Streams: the shared factor, the columns and the errors
+      const uint64_t stream = 3 * (uint64_t)r;
+      for (int i = 0; i < n; i++) {
+        const double common = std::sqrt(rho) * counter_normal(key, stream, i);
+        double mu = 0.0;
+        
+        if (intercept)
+          x(i, 0) = 1.0;
+        for (int j = first; j < p; j++)
+          x(i, j) = common + (std::sqrt(1 - rho) * counter_normal(key, stream + 1, ((uint64_t)i * p) + j));
+        for (int j = 0; j < p; j++)
+          mu += x(i, j) * truth(j);
+        
+        y(i, 0) = (mu + counter_normal(key, stream + 2, i)) > 0 ? 1.0 : 0.0;
+      } // end for (i)
+      
+      try {
+        em_fit(y, x, max_iter, async, &b, NULL, NULL, NULL, &vcov);
+      } catch (singular_design&) {
+        // Left out of the summary
+        continue;
+      } catch (std::exception& e) {
+        // Anything else (no device, out of memory, ...) stops the study
+        errors[r] = e.what();
+        continue;
+      } // end try
+      
+      // Separation: every row on the side of zero its y says
+      bool separated = true;
+      for (int i = 0; i < n && separated; i++) {
+        double mu = 0.0;
+        for (int j = 0; j < p; j++)
+          mu += x(i, j) * b(j, 0);
+        separated = (mu > 0) == (y(i, 0) == 1);
+      } // end for (i)
+      
+      bool usable = !separated;
+      for (int j = 0; j < p; j++) {
+        est(j, r) = b(j, 0);
+        std_err(j, r) = std::sqrt(vcov(j, j, 0));
+        if (!(std::abs(est(j, r)) <= beta_max) || !std::isfinite(std_err(j, r)))
+          usable = false;
+      } // end for (j)
+      ok[r] = usable ? 1 : 0;
+    } // end for (r)
+  } // end parallel
+  
+  // Report the first replicate that failed for any reason but its design
+  for (int r = 0; r < reps; r++)
+    if (!errors[r].empty())
+      stop("replicate " + std::to_string(r + 1) + ": " + errors[r]);
+  
+  // Summarize
+  NumericVector mean_est(p), bias(p), rmse(p), sd(p), mean_se(p), coverage(p);
+  IntegerVector term(p), fitted(p);
+  int used = 0;
+  for (int r = 0; r < reps; r++)
+    used += ok[r];
+  if (used == 0)
+    stop("no replicate could be fit");
+  
+  for (int j = 0; j < p; j++) {
+    double sum = 0, sum_sq = 0, sum_se = 0, covered = 0;
+    for (int r = 0; r < reps; r++) {
+      if (!ok[r])
+        continue;
+      const double err = est(j, r) - truth(j);
+      sum += est(j, r);
+      sum_sq += err * err;
+      sum_se += std_err(j, r);
+      if (std::abs(err) <= crit * std_err(j, r))
+        covered++;
+    } // end for (r)
+    
+    term[j] = j + 1;
+    fitted[j] = used;
+    mean_est[j] = sum / used;
+    bias[j] = mean_est[j] - truth(j);
+    rmse[j] = std::sqrt(sum_sq / used);
+    mean_se[j] = sum_se / used;
+    coverage[j] = covered / used;
+    
+    double ss = 0;
+    for (int r = 0; r < reps; r++)
+      if (ok[r])
+        ss += (est(j, r) - mean_est[j]) * (est(j, r) - mean_est[j]);
+    sd[j] = used > 1 ? std::sqrt(ss / (used - 1)) : NA_REAL;
+  } // end for (j)
+  
+  return DataFrame::create(Named("term") = term, Named("true") = beta,
+                           Named("mean") = mean_est, Named("bias") = bias,
+                           Named("rmse") = rmse, Named("sd") = sd,
+                           Named("mean_se") = mean_se, Named("coverage") = coverage,
+                           Named("reps") = fitted);
+} // end survivalSimulate